@@ -1,13 +1,23 @@
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cstddef>
 #include <cstring>
 #include <cinttypes>
+#include <random>
 
 #include "connection.h"
 #include "connection_p.h"
@@ -15,11 +25,11 @@
 #include "exceptions.h"
 #include "term.h"
 #include "cursor_p.h"
+#include "uring_p.h"
 
 #include "rapidjson-config.h"
-#include "rapidjson/rapidjson.h"
-#include "rapidjson/encodedstream.h"
-#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 
 namespace RethinkDB {
 
@@ -32,7 +42,41 @@ const uint32_t version_magic =
 const uint32_t json_magic =
     static_cast<uint32_t>(Protocol::VersionDummy::Protocol::JSON);
 
-std::unique_ptr<Connection> connect(std::string host, int port, std::string auth_key) {
+Clock::duration seconds(double s) {
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s));
+}
+
+Clock::time_point deadline_after(double wait) {
+    if (wait == FOREVER) {
+        return Clock::time_point::max();
+    }
+    return Clock::now() + seconds(wait);
+}
+
+std::unique_ptr<Connection> connect(std::string host, int port, std::string auth_key, ConnectOptions options) {
+    std::unique_ptr<ConnectionPrivate> conn_private = open_connection(resolve(host, port), auth_key, options);
+    return std::unique_ptr<Connection>(new Connection(conn_private.release()));
+}
+
+std::vector<Address> resolve(const std::string& host, int port) {
+    const std::string unix_prefix = "unix:";
+    if (host.compare(0, unix_prefix.size(), unix_prefix) == 0) {
+        std::string path = host.substr(unix_prefix.size());
+        Address address;
+        memset(&address, 0, sizeof address);
+        struct sockaddr_un* addr = reinterpret_cast<struct sockaddr_un*>(&address.addr);
+        if (path.empty() || path.size() >= sizeof addr->sun_path) {
+            throw Error("invalid unix socket path: %s", path.c_str());
+        }
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+        address.family = AF_UNIX;
+        address.socktype = SOCK_STREAM;
+        address.protocol = 0;
+        address.addrlen = offsetof(struct sockaddr_un, sun_path) + path.size() + 1;
+        return std::vector<Address>{address};
+    }
+
     struct addrinfo hints;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
@@ -44,34 +88,147 @@ std::unique_ptr<Connection> connect(std::string host, int port, std::string auth
     int ret = getaddrinfo(host.c_str(), port_str, &hints, &servinfo);
     if (ret) throw Error("getaddrinfo: %s\n", gai_strerror(ret));
 
-    struct addrinfo *p;
-    Error error;
-    int sockfd;
-    for (p = servinfo; p != NULL; p = p->ai_next) {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd == -1) {
-            error = Error::from_errno("socket");
-            continue;
+    std::vector<Address> addresses;
+    for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
+        Address address;
+        address.family = p->ai_family;
+        address.socktype = p->ai_socktype;
+        address.protocol = p->ai_protocol;
+        memcpy(&address.addr, p->ai_addr, p->ai_addrlen);
+        address.addrlen = p->ai_addrlen;
+        addresses.push_back(address);
+    }
+
+    freeaddrinfo(servinfo);
+    return addresses;
+}
+
+// The timeout to pass to poll in order to wake up at the deadline
+static int poll_timeout(Clock::time_point deadline) {
+    if (deadline == Clock::time_point::max()) {
+        return -1;
+    }
+    // Rounded up, so that poll does not return just before the deadline
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - Clock::now()).count() + 1;
+    return std::max(0, static_cast<int>(std::min<decltype(remaining)>(remaining, INT_MAX)));
+}
+
+static bool set_nonblocking(int sockfd, bool nonblocking) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags == -1) return false;
+    flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(sockfd, F_SETFL, flags) != -1;
+}
+
+// Connect to the addresses in order, starting the next attempt whenever
+// the previous ones have not succeeded within attempt_delay, and return
+// the first socket to connect
+static int connect_any(const std::vector<Address>& addresses,
+                       Clock::time_point deadline, double attempt_delay) {
+    Error error("connect: no address to connect to");
+    std::vector<struct pollfd> pending;
+    size_t next = 0;
+    Clock::time_point next_attempt = Clock::now();
+
+    auto close_pending = [&pending](int except) {
+        for (auto& pfd : pending) {
+            if (pfd.fd != except) ::close(pfd.fd);
         }
+    };
 
-        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            ::close(sockfd);
-            error = Error::from_errno("connect");
+    while (true) {
+        if (next < addresses.size() && (pending.empty() || Clock::now() >= next_attempt)) {
+            const Address& address = addresses[next++];
+            int sockfd = socket(address.family, address.socktype, address.protocol);
+            if (sockfd == -1) {
+                error = Error::from_errno("socket");
+                continue;
+            }
+            if (!set_nonblocking(sockfd, true)) {
+                error = Error::from_errno("fcntl");
+                ::close(sockfd);
+                continue;
+            }
+
+            if (::connect(sockfd, reinterpret_cast<const struct sockaddr*>(&address.addr),
+                          address.addrlen) == 0) {
+                close_pending(-1);
+                set_nonblocking(sockfd, false);
+                return sockfd;
+            } else if (errno != EINPROGRESS) {
+                error = Error::from_errno("connect");
+                ::close(sockfd);
+                continue;
+            }
+
+            struct pollfd pfd;
+            pfd.fd = sockfd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            pending.push_back(pfd);
+            next_attempt = Clock::now() + seconds(attempt_delay);
             continue;
         }
 
-        break;
-    }
+        if (pending.empty()) {
+            throw error;
+        }
+        if (Clock::now() >= deadline) {
+            close_pending(-1);
+            throw Error("connect: timed out");
+        }
 
-    if (p == NULL) {
-        throw error;
+        Clock::time_point wake = deadline;
+        if (next < addresses.size()) {
+            wake = std::min(wake, next_attempt);
+        }
+        int rv = poll(pending.data(), pending.size(), poll_timeout(wake));
+        if (rv == -1) {
+            if (errno == EINTR) continue;
+            error = Error::from_errno("poll");
+            close_pending(-1);
+            throw error;
+        }
+
+        for (size_t i = 0; i < pending.size(); ) {
+            if (!pending[i].revents) {
+                ++i;
+                continue;
+            }
+            int sockfd = pending[i].fd;
+            int err = 0;
+            socklen_t len = sizeof err;
+            if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+                err = errno;
+            }
+            if (err == 0) {
+                close_pending(sockfd);
+                set_nonblocking(sockfd, false);
+                return sockfd;
+            }
+            error = Error("connect: %s", strerror(err));
+            ::close(sockfd);
+            pending.erase(pending.begin() + i);
+        }
     }
+}
 
-    freeaddrinfo(servinfo);
+// Apply the options that are set on the socket itself
+static void configure_socket(int sockfd, const ConnectOptions& options) {
+#ifdef SO_BUSY_POLL
+    if (options.busy_poll > 0 && options.socket_busy_poll) {
+        int usec = options.busy_poll / MICROSECOND;
+        setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec);
+    }
+#endif
+}
 
-    std::unique_ptr<ConnectionPrivate> conn_private(new ConnectionPrivate(sockfd));
-    WriteLock writer(conn_private.get());
+static void handshake(ConnectionPrivate* conn, const std::string& auth_key,
+                      Clock::time_point deadline) {
     {
+        // The whole handshake is sent in a single write
+        WriteLock writer(conn);
         size_t size = auth_key.size();
         char buf[12 + size];
         memcpy(buf, &version_magic, 4);
@@ -82,19 +239,57 @@ std::unique_ptr<Connection> connect(std::string host, int port, std::string auth
         writer.send(buf, sizeof buf);
     }
 
-    ReadLock reader(conn_private.get());
     {
+        ReadLock reader(conn);
         const size_t max_response_length = 1024;
         char buf[max_response_length + 1];
-        size_t len = reader.recv_cstring(buf, max_response_length);
+        size_t len;
+        try {
+            len = reader.recv_cstring(buf, max_response_length, deadline);
+        } catch (const TimeoutException&) {
+            throw Error("connect: timed out waiting for the server");
+        }
         if (len == max_response_length || strcmp(buf, "SUCCESS")) {
             buf[len] = 0;
-            ::close(sockfd);
             throw Error("Server rejected connection with message: %s", buf);
         }
     }
+}
 
-    return std::unique_ptr<Connection>(new Connection(conn_private.release()));
+std::unique_ptr<ConnectionPrivate> open_connection(const std::vector<Address>& addresses,
+                                                   const std::string& auth_key,
+                                                   const ConnectOptions& options) {
+    Clock::time_point deadline = deadline_after(options.connect_timeout);
+    int sockfd = connect_any(addresses, deadline, options.connect_attempt_delay);
+    configure_socket(sockfd, options);
+
+    std::unique_ptr<ConnectionPrivate> conn_private(new ConnectionPrivate(sockfd));
+    conn_private->options = options;
+    handshake(conn_private.get(), auth_key, deadline);
+    if (options.reconnect) {
+        conn_private->addresses = addresses;
+        conn_private->auth_key = auth_key;
+    }
+
+    if (options.io_uring && !options.reconnect) {
+        StateLock guard(conn_private.get());
+        conn_private->uring_attached = uring_attach(conn_private.get());
+        if (!conn_private->uring_attached) {
+            conn_private->start_reader_thread();
+        }
+    } else if (options.reader_thread || options.reconnect) {
+        StateLock guard(conn_private.get());
+        conn_private->start_reader_thread();
+    }
+
+    return conn_private;
+}
+
+ConnectionPrivate::~ConnectionPrivate() {
+    stop_reader_thread();
+    if (guarded_sockfd != -1) {
+        ::close(guarded_sockfd);
+    }
 }
 
 Connection::Connection(ConnectionPrivate *dd) : d(dd) { }
@@ -102,32 +297,45 @@ Connection::~Connection() {
     // close();
 }
 
-size_t ReadLock::recv_some(char* buf, size_t size, double wait) {
-    if (wait != FOREVER) {
-        while (true) {
-            fd_set readfds;
-            struct timeval tv;
-
-            FD_ZERO(&readfds);
-            FD_SET(conn->guarded_sockfd, &readfds);
-
-            tv.tv_sec = (int)wait;
-            tv.tv_usec = (int)((wait - (int)wait) / MICROSECOND);
-            int rv = select(conn->guarded_sockfd + 1, &readfds, NULL, NULL, &tv);
-            if (rv == -1) {
-                throw Error::from_errno("select");
-            } else if (rv == 0) {
-                throw TimeoutException();
+size_t ReadLock::recv_some(char* buf, size_t size, Clock::time_point deadline) {
+    ssize_t numbytes = -1;
+    if (conn->options.busy_poll > 0) {
+        Clock::time_point spin_until = std::min(deadline, deadline_after(conn->options.busy_poll));
+        do {
+            numbytes = ::recv(conn->guarded_sockfd, buf, size, MSG_DONTWAIT);
+            if (numbytes != -1) break;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                throw Error::from_errno("recv");
             }
+        } while (Clock::now() < spin_until);
+    }
+
+    if (numbytes == -1) {
+        if (deadline != Clock::time_point::max()) {
+            while (true) {
+                struct pollfd pfd;
+                pfd.fd = conn->guarded_sockfd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
 
-            if (FD_ISSET(conn->guarded_sockfd, &readfds)) {
+                int rv = poll(&pfd, 1, poll_timeout(deadline));
+                if (rv == -1) {
+                    if (errno == EINTR) continue;
+                    throw Error::from_errno("poll");
+                } else if (rv == 0) {
+                    if (Clock::now() < deadline) continue;
+                    throw TimeoutException();
+                }
                 break;
             }
         }
-    }
 
-    ssize_t numbytes = ::recv(conn->guarded_sockfd, buf, size, 0);
-    if (numbytes == -1) throw Error::from_errno("recv");
+        do {
+            numbytes = ::recv(conn->guarded_sockfd, buf, size, 0);
+        } while (numbytes == -1 && errno == EINTR);
+        if (numbytes == -1) throw Error::from_errno("recv");
+    }
+    if (numbytes == 0) throw Error("recv: connection closed by the server");
     if (debug_net > 1) {
         fprintf(stderr, "<< %s\n", write_datum(std::string(buf, numbytes)).c_str());
     }
@@ -135,31 +343,85 @@ size_t ReadLock::recv_some(char* buf, size_t size, double wait) {
     return numbytes;
 }
 
-void ReadLock::recv(char* buf, size_t size, double wait) {
-    while (size) {
-        size_t numbytes = recv_some(buf, size, wait);
+void ReadLock::make_room(size_t size) {
+    const size_t min_buffer_size = 16 * 1024;
+    std::vector<char>& buffer = conn->recv_buffer;
+    if (conn->recv_start + size >= buffer.size()) {
+        // Move the remaining data to the front, and grow the buffer if that is not enough
+        size_t remaining = buffered_size();
+        memmove(buffer.data(), buffered_data(), remaining);
+        conn->recv_start = 0;
+        conn->recv_end = remaining;
+        if (size >= buffer.size()) {
+            buffer.resize(std::max(size + 1, std::max(buffer.size() * 2, min_buffer_size)));
+        }
+    }
+}
 
-        buf += numbytes;
-        size -= numbytes;
+void ReadLock::fill(size_t size, Clock::time_point deadline) {
+    make_room(size);
+    std::vector<char>& buffer = conn->recv_buffer;
+    while (buffered_size() < size) {
+        conn->recv_end += recv_some(buffer.data() + conn->recv_end,
+                                    buffer.size() - conn->recv_end, deadline);
     }
 }
 
-size_t ReadLock::recv_cstring(char* buf, size_t max_size){
-    size_t size = 0;
-    for (; size < max_size; size++) {
-        recv(buf, 1, FOREVER);
-        if (*buf == 0) {
-            break;
+void ReadLock::consume(size_t size) {
+    // As with wire_buffer, a buffer grown for an unusually large response
+    // is given back once it has been read
+    const size_t max_kept_size = 1024 * 1024;
+    conn->recv_start += size;
+    if (conn->recv_start == conn->recv_end) {
+        conn->recv_start = 0;
+        conn->recv_end = 0;
+        if (conn->recv_buffer.size() > max_kept_size) {
+            std::vector<char>().swap(conn->recv_buffer);
+        }
+    }
+}
+
+void ReadLock::recv(char* buf, size_t size, Clock::time_point deadline) {
+    fill(size, deadline);
+    memcpy(buf, buffered_data(), size);
+    consume(size);
+}
+
+size_t ReadLock::recv_cstring(char* buf, size_t max_size, Clock::time_point deadline) {
+    while (true) {
+        size_t available = std::min(buffered_size(), max_size);
+        const char* end = static_cast<const char*>(memchr(buffered_data(), 0, available));
+        if (end) {
+            size_t size = end - buffered_data();
+            memcpy(buf, buffered_data(), size + 1);
+            consume(size + 1);
+            return size;
+        }
+        if (available == max_size) {
+            memcpy(buf, buffered_data(), max_size);
+            consume(max_size);
+            return max_size;
         }
-        buf++;
+        fill(buffered_size() + 1, deadline);
+    }
+}
+
+// After a failed write, the server may have received part of a frame, so
+// nothing more can be sent, unless the connection is about to be replaced
+static Error write_error(ConnectionPrivate* conn) {
+    Error error = Error::from_errno("write");
+    if (!conn->options.reconnect) {
+        conn->set_failed(error);
     }
-    return size;
+    return error;
 }
 
 void WriteLock::send(const char* buf, size_t size) {
     while (size) {
-        ssize_t numbytes = ::write(conn->guarded_sockfd, buf, size);
-        if (numbytes == -1) throw Error::from_errno("write");
+        // Report a lost connection as an error rather than with SIGPIPE
+        ssize_t numbytes = ::send(conn->guarded_sockfd, buf, size, MSG_NOSIGNAL);
+        if (numbytes == -1 && errno == EINTR) continue;
+        if (numbytes == -1) throw write_error(conn);
         if (debug_net > 1) {
             fprintf(stderr, ">> %s\n", write_datum(std::string(buf, numbytes)).c_str());
         }
@@ -173,178 +435,1037 @@ void WriteLock::send(const std::string data) {
     send(data.data(), data.size());
 }
 
+void WriteLock::send(const std::vector<std::string>& frames) {
+    std::vector<struct iovec> iov(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        iov[i].iov_base = const_cast<char*>(frames[i].data());
+        iov[i].iov_len = frames[i].size();
+    }
+
+    size_t next = 0;
+    while (next < iov.size()) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov[next];
+        msg.msg_iovlen = std::min<size_t>(iov.size() - next, IOV_MAX);
+        ssize_t numbytes = ::sendmsg(conn->guarded_sockfd, &msg, MSG_NOSIGNAL);
+        if (numbytes == -1 && errno == EINTR) continue;
+        if (numbytes == -1) throw write_error(conn);
+
+        // Skip what was sent, which may end in the middle of a frame
+        size_t sent = numbytes;
+        while (next < iov.size() && sent >= iov[next].iov_len) {
+            sent -= iov[next].iov_len;
+            ++next;
+        }
+        if (sent) {
+            iov[next].iov_base = static_cast<char*>(iov[next].iov_base) + sent;
+            iov[next].iov_len -= sent;
+        }
+    }
+}
+
 std::string ReadLock::recv(size_t size) {
     char buf[size];
-    recv(buf, size, FOREVER);
+    recv(buf, size, Clock::time_point::max());
     return buf;
 }
 
 void Connection::close() {
-    CacheLock guard(d.get());
-    for (auto& it : d->guarded_cache) {
-        stop_query(it.first);
+    std::vector<uint64_t> tokens;
+    {
+        StateLock guard(d.get());
+        d->guarded_closing = true;
+        d->reconnect_cond.notify_all();
+    }
+    d->for_each_token([&tokens](uint64_t token, ConnectionPrivate::TokenCache& cache) {
+        if (!cache.closed) {
+            tokens.push_back(token);
+        }
+    });
+    for (uint64_t token : tokens) {
+        d->send_control(Query{QueryType::STOP, token});
     }
 
+    d->stop_reader_thread();
     int ret = ::close(d->guarded_sockfd);
+    d->guarded_sockfd = -1;
     if (ret == -1) {
         throw Error::from_errno("close");
     }
 }
 
 Response ConnectionPrivate::wait_for_response(uint64_t token_want, double wait) {
-    CacheLock guard(this);
-    ConnectionPrivate::TokenCache& cache = guarded_cache[token_want];
+    Clock::time_point deadline = deadline_after(wait);
+    TokenLock guard(this, token_want);
+    ConnectionPrivate::TokenCache& cache = guard.shard.guarded_tokens[token_want];
 
     while (true) {
         if (!cache.responses.empty()) {
-            Response response(std::move(cache.responses.front()));
-            cache.responses.pop();
-            if (cache.closed && cache.responses.empty()) {
-                guarded_cache.erase(token_want);
+            bool more;
+            Response response = pop_response(guard.shard.guarded_tokens.find(token_want), &more);
+            guard.unlock();
+            wake_reader();
+            if (more) {
+                continue_query(token_want);
             }
-
             return response;
         }
 
+        if (reader_failed) {
+            throw Error(reader_error);
+        }
+
         if (cache.closed) {
+            guard.unlock();
+            wake_reader();
             throw Error("Trying to read from a closed token");
         }
 
-        if (guarded_loop_active) {
-            cache.cond.wait(guard.inner_lock);
-        } else {
+        if (request_more(cache, true)) {
+            guard.unlock();
+            continue_query(token_want);
+            guard.lock();
+            continue;
+        }
+
+        // The thread is counted as waiting before it tries to claim the
+        // loop, so that a reader that stops in between finds it in
+        // wake_reader, which needs the shard lock
+        if (cache.waiters++ == 0) {
+            guard.shard.guarded_waiting.insert(token_want);
+        }
+        bool claimed = claim_loop();
+        bool timed_out = false;
+        if (!claimed) {
+            if (deadline == Clock::time_point::max()) {
+                cache.cond.wait(guard.inner_lock);
+            } else {
+                timed_out = cache.cond.wait_until(guard.inner_lock, deadline) == std::cv_status::timeout;
+            }
+        }
+        if (--cache.waiters == 0) {
+            guard.shard.guarded_waiting.erase(token_want);
+        }
+        if (claimed) {
             break;
         }
+        if (timed_out && cache.responses.empty() && !cache.closed) {
+            guard.unlock();
+            wake_reader();
+            throw TimeoutException();
+        }
     }
 
+    // The previous reader may still hold the read lock while it sends a
+    // CONTINUE, which takes a shard lock
+    guard.unlock();
     ReadLock reader(this);
-    return reader.read_loop(token_want, std::move(guard), wait);
+    return reader.read_loop(token_want, deadline);
 }
 
-Response ReadLock::read_loop(uint64_t token_want, CacheLock&& guard, double wait) {
-    if (!guard.inner_lock) {
-        guard.lock();
-    }
-    if (conn->guarded_loop_active) {
-        throw Error("Cannot run more than one read loop on the same connection");
-    }
-    conn->guarded_loop_active = true;
-    guard.unlock();
-
+Response ReadLock::read_loop(uint64_t token_want, Clock::time_point deadline) {
     try {
         while (true) {
-            char buf[12];
-            bzero(buf, sizeof(buf));
-            recv(buf, 12, wait);
             uint64_t token_got;
-            memcpy(&token_got, buf, 8);
-            uint32_t length;
-            memcpy(&length, buf + 8, 4);
-
-            //char buffer[length + 1];
-            //bzero(buffer, sizeof(buffer));
-            std::unique_ptr<char[]> bufmem(new char[length + 1]);
-            char *buffer = bufmem.get();
-            bzero(buffer, length + 1);
-            recv(buffer, length, wait);
-            buffer[length] = '\0';
-
-            rapidjson::Document json;
-            json.ParseInsitu(buffer);
-            if (json.HasParseError()) {
-                fprintf(stderr, "json parse error, code: %d, position: %d\n",
-                    (int)json.GetParseError(), (int)json.GetErrorOffset());
-            } else if (json.IsNull()) {
-                fprintf(stderr, "null value, read: %s\n", buffer);
-            }
-
-            Datum datum = read_datum(json);
-            if (debug_net > 0) {
-                fprintf(stderr, "[%" PRIu64 "] << %s\n", token_got, write_datum(datum).c_str());
-            }
-
-            Response response(std::move(datum));
+            Response response = recv_response(&token_got, deadline);
 
             if (token_got == token_want) {
-                guard.lock();
-                if (response.type != Protocol::Response::ResponseType::SUCCESS_PARTIAL) {
-                    auto it = conn->guarded_cache.find(token_got);
-                    if (it != conn->guarded_cache.end()) {
-                        it->second.closed = true;
-                        it->second.cond.notify_all();
+                bool more = false;
+                {
+                    TokenLock guard(conn, token_got);
+                    ConnectionPrivate::TokenMap& tokens = guard.shard.guarded_tokens;
+                    auto it = tokens.find(token_got);
+                    if (it != tokens.end()) {
+                        if (response.type != Protocol::Response::ResponseType::SUCCESS_PARTIAL) {
+                            it->second.closed = true;
+                            it->second.cond.notify_all();
+                            tokens.erase(it);
+                        } else {
+                            it->second.more = true;
+                            more = conn->request_more(it->second, false);
+                        }
                     }
-                    conn->guarded_cache.erase(it);
                 }
-                conn->guarded_loop_active = false;
-                for (auto& it : conn->guarded_cache) {
-                    it.second.cond.notify_all();
+                conn->loop_active = false;
+                conn->wake_reader();
+                if (more) {
+                    conn->continue_query(token_got);
                 }
                 return response;
             } else {
-                guard.lock();
-                auto it = conn->guarded_cache.find(token_got);
-                if (it == conn->guarded_cache.end()) {
-                    // drop the response
-                } else if (!it->second.closed) {
-                    it->second.responses.emplace(std::move(response));
-                    if (response.type != Protocol::Response::ResponseType::SUCCESS_PARTIAL) {
-                        it->second.closed = true;
-                    }
-                }
-                it->second.cond.notify_all();
-                guard.unlock();
+                // The response may be for an asynchronous query, whose
+                // reader thread is waiting for this read lock
+                conn->deliver_response(token_got, std::move(response));
             }
         }
     } catch (const TimeoutException &e) {
-        if (!guard.inner_lock){
-            guard.lock();
-        }
-        conn->guarded_loop_active = false;
+        conn->loop_active = false;
+        conn->wake_reader();
         throw e;
+    } catch (const Error& error) {
+        conn->loop_active = false;
+
+        // The rest of the responses can not be read either
+        conn->set_failed(error);
+        throw;
+    }
+}
+
+void ConnectionPrivate::wake_reader() {
+    if (loop_active || reader_running) {
+        return;
+    }
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if (shard.guarded_waiting.empty()) {
+            continue;
+        }
+        auto it = shard.guarded_tokens.find(*shard.guarded_waiting.begin());
+        if (it != shard.guarded_tokens.end()) {
+            it->second.cond.notify_one();
+            return;
+        }
+    }
+}
+
+bool ReadLock::has_response() const {
+    if (buffered_size() < 12) {
+        return false;
+    }
+    uint32_t length;
+    memcpy(&length, conn->recv_buffer.data() + conn->recv_start + 8, 4);
+    return buffered_size() >= 12 + length;
+}
+
+// Read the type of a response that starts with it, without parsing the rest
+static bool peek_response_type(const char* json, size_t length, double* type) {
+    const char* end = json + length;
+    const char* expected[] = {"{", "\"t\"", ":"};
+    for (const char* token : expected) {
+        while (json < end && isspace(static_cast<unsigned char>(*json))) {
+            ++json;
+        }
+        size_t size = strlen(token);
+        if (static_cast<size_t>(end - json) < size || memcmp(json, token, size)) {
+            return false;
+        }
+        json += size;
+    }
+    while (json < end && isspace(static_cast<unsigned char>(*json))) {
+        ++json;
+    }
+
+    // Response types have at most two digits
+    int n = 0;
+    const char* digits = json;
+    for (; json < end && json - digits < 2 && *json >= '0' && *json <= '9'; ++json) {
+        n = n * 10 + (*json - '0');
+    }
+    if (json == digits || json == end ||
+        (*json != ',' && *json != '}' && !isspace(static_cast<unsigned char>(*json)))) {
+        return false;
+    }
+    *type = n;
+    return true;
+}
+
+Response ReadLock::recv_response(uint64_t* token_got, Clock::time_point deadline) {
+    fill(12, deadline);
+    memcpy(token_got, buffered_data(), 8);
+    uint32_t length;
+    memcpy(&length, buffered_data() + 8, 4);
+
+    fill(12 + length, deadline);
+    char *buffer = buffered_data() + 12;
+
+    // Results are only kept as JSON until consumed, but the type is needed
+    // right away. It normally comes first, otherwise the whole response is parsed
+    double type;
+    if (conn->options.defer_parsing && peek_response_type(buffer, length, &type) &&
+        (type == static_cast<double>(Protocol::Response::ResponseType::SUCCESS_PARTIAL) ||
+         type == static_cast<double>(Protocol::Response::ResponseType::SUCCESS_SEQUENCE) ||
+         type == static_cast<double>(Protocol::Response::ResponseType::SUCCESS_ATOM))) {
+        Response response(response_type(type), Protocol::Response::ErrorType(0), Array());
+        response.unparsed.assign(buffer, length);
+        response.size = 12 + length;
+        consume(12 + length);
+        return response;
     }
+
+    // Parse the response in place, temporarily terminating it with a null
+    // byte, which may overwrite the beginning of the next response
+    char next = buffer[length];
+    buffer[length] = '\0';
+
+    ResponseFields fields;
+    bool parsed = read_response(buffer, &fields);
+    buffer[length] = next;
+    consume(12 + length);
+    if (!parsed) {
+        throw Error("Invalid response from the server");
+    }
+    if (debug_net > 0) {
+        fprintf(stderr, "[%" PRIu64 "] << %s\n", *token_got,
+                write_datum(Object{{"t", fields.type}, {"r", fields.result}}).c_str());
+    }
+
+    using ET = Protocol::Response::ErrorType;
+    Response response(response_type(fields.type),
+                      fields.error_type ? runtime_error_type(fields.error_type) : ET(0),
+                      std::move(fields.result));
+    response.size = 12 + length;
+    return response;
+}
+
+bool ConnectionPrivate::cache_response(uint64_t token, Response&& response) {
+    TokenMap& tokens = shard(token).guarded_tokens;
+    auto it = tokens.find(token);
+    if (it == tokens.end()) {
+        // drop the response
+        return false;
+    }
+    it->second.replay = std::string();
+    bool more = false;
+    if (!it->second.closed) {
+        bool partial = response.type == Protocol::Response::ResponseType::SUCCESS_PARTIAL;
+        it->second.queued_bytes += response.size;
+        it->second.responses.emplace(std::move(response));
+        if (!partial) {
+            it->second.closed = true;
+        } else {
+            it->second.more = true;
+            more = request_more(it->second, false);
+        }
+    }
+    it->second.cond.notify_all();
+    return more;
+}
+
+void ConnectionPrivate::wait_for_response_async(uint64_t token,
+                                                std::function<void(Response&&)> callback,
+                                                std::function<void(Error&&)> errback) {
+    TokenLock guard(this, token);
+    TokenCache& cache = guard.shard.guarded_tokens[token];
+
+    if (!cache.responses.empty()) {
+        bool more;
+        Response response = pop_response(guard.shard.guarded_tokens.find(token), &more);
+        guard.unlock();
+        if (more) {
+            continue_query(token);
+        }
+        callback(std::move(response));
+    } else if (reader_failed) {
+        Error error(reader_error);
+        guard.unlock();
+        errback(std::move(error));
+    } else if (cache.closed) {
+        guard.unlock();
+        errback(Error("Trying to read from a closed token"));
+    } else {
+        cache.callback = std::move(callback);
+        cache.errback = std::move(errback);
+        bool more = request_more(cache, true);
+        guard.unlock();
+        {
+            StateLock state_guard(this);
+            start_reader_thread();
+        }
+        if (more) {
+            try {
+                continue_query(token);
+            } catch (const Error&) {
+                // The reader finds out that the connection was lost, and calls errback
+            }
+        }
+    }
+}
+
+void ConnectionPrivate::cancel_async(uint64_t token) {
+    TokenLock guard(this, token);
+    auto it = guard.shard.guarded_tokens.find(token);
+    if (it != guard.shard.guarded_tokens.end()) {
+        it->second.callback = nullptr;
+        it->second.errback = nullptr;
+    }
+}
+
+void ConnectionPrivate::start_reader_thread() {
+    if (reader_running) {
+        return;
+    }
+    reader_running = true;
+    reader_thread = std::thread(&ConnectionPrivate::reader_loop, this);
+}
+
+void ConnectionPrivate::stop_reader_thread() {
+    if (uring_attached) {
+        uring_attached = false;
+        uring_detach(this);
+    }
+    if (!reader_thread.joinable()) {
+        return;
+    }
+    {
+        // reconnect replaces the socket under the state lock, so this
+        // wakes up the reader thread from the current one, and it does not
+        // make a new one
+        StateLock guard(this);
+        guarded_closing = true;
+        reconnect_cond.notify_all();
+        ::shutdown(guarded_sockfd, SHUT_RDWR);
+    }
+    reader_thread.join();
+}
+
+void ConnectionPrivate::reader_loop() {
+#ifdef __linux__
+    if (options.reader_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(options.reader_cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+    }
+#endif
+
+    while (true) {
+        try {
+            ReadLock reader(this);
+            while (true) {
+                uint64_t token;
+                Response response = reader.recv_response(&token, Clock::time_point::max());
+                deliver_response(token, std::move(response));
+            }
+        } catch (const Error& error) {
+            if (!options.reconnect || !reconnect()) {
+                fail(error);
+                return;
+            }
+        }
+    }
+}
+
+// The response given to queries that were lost with the connection
+static Response lost_response() {
+    using ET = Protocol::Response::ErrorType;
+    return Response(Datum(Object{
+        {"t", static_cast<double>(Protocol::Response::ResponseType::RUNTIME_ERROR)},
+        {"e", static_cast<double>(ET::OP_INDETERMINATE)},
+        {"r", Array{"Connection lost before the query completed. It was not sent again "
+                    "because it is not read-only or had already returned results"}}}));
+}
+
+bool ConnectionPrivate::reconnect() {
+    {
+        WriteLock writer(this);
+        reconnecting = true;
+    }
+
+    // Queries that have nothing to replay fail right away
+    std::vector<uint64_t> lost;
+    {
+        StateLock guard(this);
+        if (guarded_closing) {
+            return false;
+        }
+    }
+    for_each_token([&lost](uint64_t token, TokenCache& cache) {
+        if (!cache.closed && cache.replay.empty()) {
+            lost.push_back(token);
+        }
+    });
+    for (uint64_t token : lost) {
+        deliver_response(token, lost_response());
+    }
+
+    // Back off exponentially, with jitter so that many clients losing the
+    // same server do not all come back at once
+    std::minstd_rand random(Clock::now().time_since_epoch().count());
+    std::uniform_real_distribution<double> jitter(0.5, 1);
+    double delay = 0;
+    while (true) {
+        {
+            StateLock guard(this);
+            if (delay > 0) {
+                reconnect_cond.wait_for(guard.inner_lock, seconds(delay * jitter(random)));
+            }
+            if (guarded_closing) {
+                return false;
+            }
+        }
+
+        try {
+            Clock::time_point deadline = deadline_after(options.connect_timeout);
+            int sockfd = connect_any(addresses, deadline, options.connect_attempt_delay);
+            configure_socket(sockfd, options);
+            {
+                WriteLock writer(this);
+                ReadLock reader(this);
+                StateLock guard(this);
+                if (guarded_closing) {
+                    ::close(sockfd);
+                    return false;
+                }
+                ::close(guarded_sockfd);
+                guarded_sockfd = sockfd;
+                recv_start = 0;
+                recv_end = 0;
+            }
+            handshake(this, auth_key, deadline);
+            break;
+        } catch (const Error&) {
+            delay = std::min(std::max(delay * 2, 0.1 * SECOND), options.max_reconnect_delay);
+        }
+    }
+
+    WriteLock writer(this);
+    std::string frames;
+    for_each_token([&frames](uint64_t, TokenCache& cache) {
+        frames += cache.replay;
+    });
+    reconnecting = false;
+    try {
+        writer.send(frames);
+    } catch (const Error&) {
+        // The reader will find out that the connection was lost again
+    }
+    return true;
+}
+
+// Whether the term can be run again without side effects
+static bool is_read_only(const Datum& term) {
+    using TT = Protocol::Term::TermType;
+    const Array* array = term.get_array();
+    if (array) {
+        if (array->empty() || !(*array)[0].get_number()) {
+            return true;
+        }
+        switch (static_cast<TT>(*(*array)[0].get_number())) {
+        case TT::INSERT: case TT::UPDATE: case TT::REPLACE: case TT::DELETE:
+        case TT::DB_CREATE: case TT::DB_DROP: case TT::TABLE_CREATE: case TT::TABLE_DROP:
+        case TT::INDEX_CREATE: case TT::INDEX_DROP: case TT::INDEX_RENAME:
+        case TT::RECONFIGURE: case TT::REBALANCE: case TT::SYNC: case TT::GRANT:
+        case TT::HTTP:
+            return false;
+        default:
+            break;
+        }
+        if (array->size() > 1 && (*array)[1].get_array()) {
+            for (const auto& arg : *(*array)[1].get_array()) {
+                if (!is_read_only(arg)) return false;
+            }
+        }
+        if (array->size() > 2 && (*array)[2].get_object()) {
+            for (const auto& it : *(*array)[2].get_object()) {
+                if (!is_read_only(it.second)) return false;
+            }
+        }
+        return true;
+    }
+
+    const Object* object = term.get_object();
+    if (object) {
+        for (const auto& it : *object) {
+            if (!is_read_only(it.second)) return false;
+        }
+    }
+    return true;
+}
+
+// Call the callback of an asynchronous operation. What it throws is
+// reported to that operation's errback, so that it does not reach the
+// thread that reads for the whole connection
+static void run_callback(const std::function<void(Response&&)>& callback,
+                         const std::function<void(Error&&)>& errback, Response&& response) {
+    try {
+        try {
+            callback(std::move(response));
+        } catch (Error& error) {
+            errback(std::move(error));
+        } catch (const std::exception& exception) {
+            errback(Error("callback failed: %s", exception.what()));
+        } catch (...) {
+            errback(Error("callback failed"));
+        }
+    } catch (...) {
+        // There is nowhere left to report it
+    }
+}
+
+// Call the errback of an asynchronous operation, ignoring what it throws
+static void run_errback(const std::function<void(Error&&)>& errback, Error&& error) {
+    try {
+        errback(std::move(error));
+    } catch (...) {
+    }
+}
+
+void ConnectionPrivate::deliver_response(uint64_t token, Response&& response) {
+    TokenLock guard(this, token);
+    auto it = guard.shard.guarded_tokens.find(token);
+    std::function<void(Response&&)> callback;
+    std::function<void(Error&&)> errback;
+    bool more;
+    if (it == guard.shard.guarded_tokens.end() || !it->second.callback) {
+        more = cache_response(token, std::move(response));
+    } else {
+        callback = std::move(it->second.callback);
+        errback = std::move(it->second.errback);
+        it->second.callback = nullptr;
+        it->second.errback = nullptr;
+        it->second.replay = std::string();
+        if (response.type != Protocol::Response::ResponseType::SUCCESS_PARTIAL) {
+            guard.shard.guarded_tokens.erase(it);
+            more = false;
+        } else {
+            it->second.more = true;
+            more = request_more(it->second, false);
+        }
+    }
+    guard.unlock();
+
+    if (more) {
+        try {
+            continue_query(token);
+        } catch (const Error&) {
+            // The reader finds out that the connection was lost
+        }
+    }
+    if (callback) {
+        run_callback(callback, errback, std::move(response));
+    }
+}
+
+void ConnectionPrivate::set_failed(const Error& error) {
+    {
+        StateLock guard(this);
+        if (reader_failed) {
+            return;
+        }
+        reader_error = Error(error);
+        reader_failed = true;
+    }
+
+    // Waiting threads check reader_failed under their shard lock
+    for_each_token([](uint64_t, TokenCache& cache) {
+        cache.cond.notify_all();
+    });
+}
+
+void ConnectionPrivate::fail(const Error& error) {
+    set_failed(error);
+    std::vector<std::function<void(Error&&)>> errbacks;
+    for_each_token([&errbacks](uint64_t, TokenCache& cache) {
+        if (cache.errback) {
+            errbacks.emplace_back(std::move(cache.errback));
+            cache.callback = nullptr;
+            cache.errback = nullptr;
+        }
+    });
+    for (auto& errback : errbacks) {
+        run_errback(errback, Error(error));
+    }
+}
+
+struct WireBuffer {
+    WireBuffer() : writer(buffer) { }
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer;
+};
+
+// The calling thread's wire buffer, emptied. It keeps its capacity from
+// one query to the next, unless it grew larger than is worth keeping
+static WireBuffer& wire_buffer() {
+    const size_t max_kept_size = 1024 * 1024;
+    static thread_local WireBuffer wire;
+    bool large = wire.buffer.GetSize() > max_kept_size;
+    wire.buffer.Clear();
+    if (large) {
+        wire.buffer.ShrinkToFit();
+    }
+    return wire;
+}
+
+size_t Query::serialize(WireBuffer* wire) const {
+    rapidjson::StringBuffer& buffer = wire->buffer;
+    size_t start = buffer.GetSize();
+    buffer.Push(12);
+
+    wire->writer.Reset(buffer);
+    wire->writer.StartArray();
+    wire->writer.Int(static_cast<int>(type));
+    const Datum& query_term = borrowed_term ? *borrowed_term : term;
+    if (query_term.is_valid()) {
+        query_term.write_json(&wire->writer);
+    }
+    if (!optArgs.empty()) {
+        wire->writer.StartObject();
+        for (const auto& it : optArgs) {
+            wire->writer.Key(it.first.data(), it.first.size());
+            it.second.datum.write_json(&wire->writer);
+        }
+        wire->writer.EndObject();
+    }
+    wire->writer.EndArray();
+
+    uint32_t length = buffer.GetSize() - start - 12;
+    char* frame = const_cast<char*>(buffer.GetString()) + start;
+    memcpy(frame, &token, 8);
+    memcpy(frame + 8, &length, 4);
+    if (debug_net > 0) {
+        fprintf(stderr, "[%" PRIu64 "] >> %.*s\n", token, static_cast<int>(length), frame + 12);
+    }
+    return start;
+}
+
+std::string Query::serialize() const {
+    WireBuffer& wire = wire_buffer();
+    serialize(&wire);
+    return std::string(wire.buffer.GetString(), wire.buffer.GetSize());
 }
 
 void ConnectionPrivate::run_query(Query query, bool no_reply) {
+    run_queries(&query, 1);
+}
+
+void ConnectionPrivate::run_queries(Query* queries, size_t count) {
+    WireBuffer& wire = wire_buffer();
+    std::vector<std::string> replays;
+    if (options.reconnect) {
+        replays.resize(count);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const Datum& term = queries[i].borrowed_term ? *queries[i].borrowed_term : queries[i].term;
+        bool replay = options.reconnect && queries[i].type == QueryType::START &&
+            !queries[i].optArgs.count("noreply") && is_read_only(term);
+        size_t start = queries[i].serialize(&wire);
+        if (replay) {
+            replays[i].assign(wire.buffer.GetString() + start, wire.buffer.GetSize() - start);
+        }
+    }
+
     WriteLock writer(this);
-    writer.send(query.serialize());
+
+    // Only queries that get an answer can be replayed, and only those that
+    // are registered in the cache do
+    bool replayable = true;
+    if (options.reconnect) {
+        for (size_t i = 0; i < count; ++i) {
+            TokenLock guard(this, queries[i].token);
+            auto it = guard.shard.guarded_tokens.find(queries[i].token);
+            if (!replays[i].empty() && it != guard.shard.guarded_tokens.end() && !it->second.closed) {
+                it->second.replay = std::move(replays[i]);
+            } else if (queries[i].type == QueryType::START) {
+                replayable = false;
+            }
+        }
+    }
+
+    if (reconnecting) {
+        if (!replayable) {
+            throw Error("Connection lost, reconnecting. Only read-only queries are retried");
+        }
+        // Read-only queries are sent once reconnected, and continuing or
+        // stopping a query is pointless since it has been lost
+        return;
+    }
+
+    try {
+        writer.send(wire.buffer.GetString(), wire.buffer.GetSize());
+    } catch (const Error&) {
+        if (!options.reconnect || !replayable) {
+            throw;
+        }
+    }
 }
 
-Cursor Connection::start_query(Term *term, OptArgs&& opts) {
+Cursor Connection::start_query(Term *term, OptArgs&& opts, double wait) {
     bool no_reply = false;
     auto it = opts.find("noreply");
     if (it != opts.end()) {
         no_reply = *(it->second.datum.get_boolean());
     }
 
+    uint64_t shape = 0;
+    if (d->options.tune_batches && !no_reply) {
+        shape = BatchTuner::shape(term->datum);
+        d->tuner.apply(shape, opts);
+    }
+
+    // Noreply queries are never answered, so they are not added to the cache
     uint64_t token = d->new_token();
-    {
-        CacheLock guard(d.get());
-        d->guarded_cache[token];
+    if (!no_reply) {
+        d->add_token(token);
     }
 
-    d->run_query(Query{QueryType::START, token, term->datum, std::move(opts)});
+    Clock::time_point started = Clock::now();
+    try {
+        d->run_query(Query{QueryType::START, token, Datum(), std::move(opts), &term->datum});
+    } catch (const Error&) {
+        d->remove_token(token);
+        throw;
+    }
     if (no_reply) {
         return Cursor(new CursorPrivate(token, this, Nil()));
     }
 
     Cursor cursor(new CursorPrivate(token, this));
-    Response response = d->wait_for_response(token, FOREVER);
-    cursor.d->add_response(std::move(response));
+    cursor.d->shape = shape;
+    cursor.d->started = started;
+    try {
+        cursor.d->add_response(d->wait_for_response(token, wait));
+        cursor.d->waited += Clock::now() - started;
+    } catch (const TimeoutException&) {
+        // Stop the query, and drop its response if it arrives later
+        cursor.close();
+        d->remove_token(token);
+        throw;
+    } catch (const Error&) {
+        // The token is left behind if the connection failed before the response
+        d->remove_token(token);
+        throw;
+    }
     return cursor;
 }
 
+std::vector<Cursor> Connection::run_many(std::vector<Term>&& terms, OptArgs&& opts) {
+    bool no_reply = false;
+    auto it = opts.find("noreply");
+    if (it != opts.end()) {
+        no_reply = *(it->second.datum.get_boolean());
+    }
+
+    for (const auto& term : terms) {
+        if (!term.free_vars.empty()) {
+            throw Error("run_many: term has free variables");
+        }
+    }
+
+    std::vector<uint64_t> tokens;
+    tokens.reserve(terms.size());
+    std::vector<Query> queries;
+    queries.reserve(terms.size());
+    for (auto& term : terms) {
+        uint64_t token = d->new_token();
+        tokens.push_back(token);
+        queries.emplace_back(Query{QueryType::START, token, std::move(term.datum), OptArgs(opts)});
+    }
+
+    if (!no_reply) {
+        for (uint64_t token : tokens) {
+            d->add_token(token);
+        }
+    }
+
+    try {
+        d->run_queries(std::move(queries));
+    } catch (const Error&) {
+        for (uint64_t token : tokens) {
+            d->remove_token(token);
+        }
+        throw;
+    }
+
+    std::vector<Cursor> cursors;
+    cursors.reserve(tokens.size());
+    if (no_reply) {
+        for (uint64_t token : tokens) {
+            cursors.emplace_back(Cursor(new CursorPrivate(token, this, Nil())));
+        }
+        return cursors;
+    }
+
+    // Wait for every response, even after an error, so that none are left behind
+    bool failed = false;
+    Error error;
+    for (uint64_t token : tokens) {
+        Cursor cursor(new CursorPrivate(token, this));
+        try {
+            cursor.d->add_response(d->wait_for_response(token, FOREVER));
+        } catch (Error& e) {
+            d->remove_token(token);
+            if (!failed) {
+                failed = true;
+                error = std::move(e);
+            }
+        }
+        cursors.emplace_back(std::move(cursor));
+    }
+
+    if (failed) {
+        throw error;
+    }
+    return cursors;
+}
+
+void Connection::start_query_async(Term *term, OptArgs&& opts,
+                                   std::function<void(Cursor&&)> callback,
+                                   std::function<void(Error&&)> errback) {
+    bool no_reply = false;
+    auto it = opts.find("noreply");
+    if (it != opts.end()) {
+        no_reply = *(it->second.datum.get_boolean());
+    }
+
+    uint64_t token = d->new_token();
+    if (no_reply) {
+        d->run_query(Query{QueryType::START, token, Datum(), std::move(opts), &term->datum});
+        callback(Cursor(new CursorPrivate(token, this, Nil())));
+        return;
+    }
+
+    d->add_token(token);
+
+    // Register for the first response before sending the query, so that the
+    // reader thread cannot receive it first
+    std::shared_ptr<CursorPrivate> cursor(new CursorPrivate(token, this));
+    d->wait_for_response_async(token, [cursor, callback, errback](Response&& response) {
+        try {
+            cursor->add_response(std::move(response));
+        } catch (Error& error) {
+            errback(std::move(error));
+            return;
+        }
+        callback(Cursor(new CursorPrivate(std::move(*cursor))));
+    }, errback);
+
+    try {
+        d->run_query(Query{QueryType::START, token, Datum(), std::move(opts), &term->datum});
+    } catch (const Error&) {
+        d->remove_token(token);
+        throw;
+    }
+}
+
 void Connection::stop_query(uint64_t token) {
-    const auto& it = d->guarded_cache.find(token);
-    if (it != d->guarded_cache.end() && !it->second.closed) {
-        d->run_query(Query{QueryType::STOP, token}, true);
+    {
+        TokenLock guard(d.get(), token);
+        const auto& it = guard.shard.guarded_tokens.find(token);
+        if (it == guard.shard.guarded_tokens.end() || it->second.closed) {
+            return;
+        }
+    }
+    d->send_control(Query{QueryType::STOP, token});
+}
+
+void Connection::noreply_wait(double wait) {
+    uint64_t token = d->new_token();
+    d->add_token(token);
+
+    try {
+        d->run_query(Query{QueryType::NOREPLY_WAIT, token});
+        Response response = d->wait_for_response(token, wait);
+        if (response.type != Protocol::Response::ResponseType::WAIT_COMPLETE) {
+            throw response.as_error();
+        }
+    } catch (...) {
+        d->remove_token(token);
+        throw;
     }
 }
 
 void Connection::continue_query(uint64_t token) {
-    d->run_query(Query{QueryType::CONTINUE, token}, true);
+    d->continue_query(token);
+}
+
+void ConnectionPrivate::continue_query(uint64_t token) {
+    send_control(Query{QueryType::CONTINUE, token});
+}
+
+void ConnectionPrivate::send_control(Query&& query) {
+    {
+        std::lock_guard<std::mutex> guard(outbox_lock);
+        guarded_outbox.emplace_back(query.serialize());
+        if (guarded_flushing) {
+            return;
+        }
+        guarded_flushing = true;
+    }
+
+    // Frames queued while waiting for the write lock go out with this one
+    WriteLock writer(this);
+    std::vector<std::string> frames;
+    while (true) {
+        frames.clear();
+        {
+            std::lock_guard<std::mutex> guard(outbox_lock);
+            frames.swap(guarded_outbox);
+            if (frames.empty()) {
+                guarded_flushing = false;
+                return;
+            }
+        }
+
+        // Continuing or stopping a query is pointless once it has been lost
+        if (reconnecting) {
+            continue;
+        }
+
+        try {
+            writer.send(frames);
+        } catch (const Error&) {
+            std::lock_guard<std::mutex> guard(outbox_lock);
+            guarded_outbox.clear();
+            guarded_flushing = false;
+            throw;
+        }
+    }
+}
+
+void ConnectionPrivate::add_token(uint64_t token) {
+    TokenLock guard(this, token);
+    TokenCache& cache = guard.shard.guarded_tokens[token];
+    cache.prefetch_batches = options.prefetch_batches;
+    cache.prefetch_bytes = options.prefetch_bytes;
+}
+
+void ConnectionPrivate::remove_token(uint64_t token) {
+    TokenLock guard(this, token);
+    guard.shard.guarded_tokens.erase(token);
+}
+
+bool ConnectionPrivate::request_more(TokenCache& cache, bool needed) {
+    if (!cache.more) {
+        return false;
+    }
+    bool room = cache.responses.size() < cache.prefetch_batches &&
+        (cache.prefetch_bytes == 0 || cache.queued_bytes < cache.prefetch_bytes);
+    if (!room && !(needed && cache.responses.empty())) {
+        return false;
+    }
+    cache.more = false;
+    return true;
+}
+
+Response ConnectionPrivate::pop_response(TokenMap::iterator it, bool* more) {
+    TokenCache& cache = it->second;
+    Response response(std::move(cache.responses.front()));
+    cache.responses.pop();
+    cache.queued_bytes -= response.size;
+    *more = request_more(cache, false);
+    if (cache.closed && cache.responses.empty()) {
+        shard(it->first).guarded_tokens.erase(it);
+    }
+    return response;
+}
+
+void Response::parse() {
+    if (unparsed.empty()) {
+        return;
+    }
+    ResponseFields fields;
+    bool parsed = read_response(&unparsed[0], &fields);
+    std::string().swap(unparsed);
+    if (!parsed) {
+        throw Error("Invalid response from the server");
+    }
+    result = std::move(fields.result);
 }
 
 Error Response::as_error() {
+    parse();
     std::string repr;
     if (result.size() == 1) {
         std::string* string = result[0].get_string();
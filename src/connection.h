@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <queue>
 #include <mutex>
 #include <memory>
@@ -19,6 +20,82 @@ namespace RethinkDB {
 class Term;
 using OptArgs = std::map<std::string, Term>;
 
+// Options that change how a Connection talks to the server
+struct ConnectOptions {
+    // Read responses on a dedicated background thread that hands each one
+    // directly to the query waiting for it. By default, whichever caller
+    // needs a response first reads on behalf of all the others. Without
+    // this option or io_uring, the reader thread is started by the first
+    // run_async that has to wait for its results, and keeps reading until
+    // the connection is closed, for asynchronous and blocking queries alike.
+    bool reader_thread = false;
+
+    // Like reader_thread, but a single thread reads for all the connections
+    // that set this option, waiting on all of their sockets at once through
+    // io_uring. Requires Linux and a build with IO_URING, which is the
+    // default when the kernel headers support it, otherwise a reader thread
+    // is used instead. Callbacks of asynchronous queries run on the shared
+    // thread, and must not block. They may close or destroy their connection.
+    bool io_uring = false;
+
+    // When the connection is lost, reconnect in the background and send
+    // again the queries that are read-only and had not returned anything
+    // yet. Other queries that were running fail with ReqlOpIndeterminateError,
+    // and queries other than read-only ones fail right away until the
+    // connection is back. Reading is done on a reader thread, even if
+    // io_uring is set.
+    bool reconnect = false;
+
+    // Attempts to reconnect start right away, then back off exponentially
+    // up to this delay between attempts
+    double max_reconnect_delay = 5 * SECOND;
+
+    // Learn how the results of each kind of query are consumed, and pick
+    // the batch optargs (max_batch_rows, max_batch_bytes and
+    // first_batch_scaledown_factor) of later queries of the same shape
+    // accordingly. Queries that are usually closed early get small batches,
+    // and scans that wait for the server get larger ones. Applies to queries
+    // started with run() that set none of these optargs.
+    bool tune_batches = false;
+
+    // Before waiting for data in recv, check the socket without blocking
+    // for up to this long. Responses that arrive within that time are read
+    // without the cost of a wakeup, which saves tens of microseconds per
+    // round trip on quick queries, at the cost of a busy CPU. Only pays off
+    // when that CPU would otherwise be idle. 0 disables
+    double busy_poll = 0;
+
+    // When busy_poll is set, also have the kernel poll the network device
+    // for that long on reads (SO_BUSY_POLL). Ignored if the process is not
+    // allowed to, which usually requires CAP_NET_ADMIN, and on systems
+    // other than Linux
+    bool socket_busy_poll = false;
+
+    // Pin the reader thread to this CPU, if possible. -1 leaves it
+    // unpinned. Only supported on Linux
+    int reader_cpu = -1;
+
+    // Parse the results of responses on the thread that consumes them
+    // instead of the one that receives them. The datums of a batch are then
+    // allocated and freed by the same thread, so that many threads reading
+    // cursors do not contend on the allocator of a shared reader thread,
+    // and the parsing is spread over them. Mostly useful with reader_thread
+    // or io_uring
+    bool defer_parsing = false;
+
+    // The default prefetch window of cursors. See Cursor::set_prefetch
+    size_t prefetch_batches = 1;
+    size_t prefetch_bytes = 0;
+
+    // Give up if the connection and handshake take longer than this
+    double connect_timeout = 20 * SECOND;
+
+    // When a host resolves to several addresses, try the next one if the
+    // previous attempts have not succeeded after this delay, and keep the
+    // first connection that succeeds
+    double connect_attempt_delay = 0.25 * SECOND;
+};
+
 // A connection to a RethinkDB server
 // It contains:
 //  * A socket
@@ -36,11 +113,24 @@ public:
 
     void close();
 
+    // Wait until the server has processed every query sent so far,
+    // including noreply queries. Throws TimeoutException after wait seconds
+    void noreply_wait(double wait = FOREVER);
+
+    // Send all the terms to the server at once, then wait for all of
+    // their first batches. The optargs are passed to each query.
+    // Returns one cursor per term, in the same order. If any of the
+    // queries fail, the first error is thrown.
+    std::vector<Cursor> run_many(std::vector<Term>&& terms, OptArgs&& args = {});
+
 private:
     explicit Connection(ConnectionPrivate *dd);
     std::unique_ptr<ConnectionPrivate> d;
 
-    Cursor start_query(Term *term, OptArgs&& args);
+    Cursor start_query(Term *term, OptArgs&& args, double wait);
+    void start_query_async(Term *term, OptArgs&& args,
+                           std::function<void(Cursor&&)> callback,
+                           std::function<void(Error&&)> errback);
     void stop_query(uint64_t);
     void continue_query(uint64_t);
 
@@ -48,12 +138,18 @@ private:
     friend class CursorPrivate;
     friend class Token;
     friend class Term;
+    friend class ConnectionPoolPrivate;
+    friend class IngestStream;
+    friend class IngestStreamPrivate;
     friend std::unique_ptr<Connection>
-        connect(std::string host, int port, std::string auth_key);
+        connect(std::string host, int port, std::string auth_key, ConnectOptions options);
 
 };
 
 // $doc(connect)
-std::unique_ptr<Connection> connect(std::string host = "localhost", int port = 28015, std::string auth_key = "");
+// A host of the form "unix:/path/to/socket" connects to a Unix domain socket
+// instead, in which case the port is ignored.
+std::unique_ptr<Connection> connect(std::string host = "localhost", int port = 28015, std::string auth_key = "",
+                                    ConnectOptions options = ConnectOptions());
 
 }
@@ -2,39 +2,51 @@
 #define CONNECTION_P_H
 
 #include <inttypes.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "connection.h"
 #include "term.h"
 #include "json_p.h"
+#include "tuner_p.h"
 
 namespace RethinkDB {
 
 extern const int debug_net;
 
+using Clock = std::chrono::steady_clock;
+
+// Converts a duration in seconds into the clock's units
+Clock::duration seconds(double);
+
+// The absolute time at which a wait of the given length (or FOREVER) ends
+Clock::time_point deadline_after(double wait);
+
+// The buffer that a thread serializes queries into. See wire_buffer
+struct WireBuffer;
+
 struct Query {
     Protocol::Query::QueryType type;
     uint64_t token;
     Datum term;
     OptArgs optArgs;
 
-    std::string serialize() {
-        Array query_arr{static_cast<double>(type)};
-        if (term.is_valid()) query_arr.emplace_back(term);
-        if (!optArgs.empty())
-            query_arr.emplace_back(Term(std::move(optArgs)).datum);
+    // Sent in place of term when set, to send a term that belongs to the
+    // caller without copying it. Must stay valid until the query is sent
+    const Datum* borrowed_term;
 
-        std::string query_str = write_datum(query_arr);
-        if (debug_net > 0) {
-            fprintf(stderr, "[%" PRIu64 "] >> %s\n", token, query_str.c_str());
-        }
+    // Append the frame of the query to the buffer. The JSON is written
+    // after room for the header, whose length is filled in afterwards.
+    // Returns the offset of the frame in the buffer
+    size_t serialize(WireBuffer*) const;
 
-        char header[12];
-        memcpy(header, &token, 8);
-        uint32_t size = query_str.size();
-        memcpy(header + 8, &size, 4);
-        query_str.insert(0, header, 12);
-        return query_str;
-    }
+    std::string serialize() const;
 };
 
 // Used internally to convert a raw response type into an enum
@@ -50,46 +62,248 @@ public:
         error_type(datum.get_field("e") ?
                    runtime_error_type(std::move(datum).extract_field("e").extract_number()) :
                    Protocol::Response::ErrorType(0)),
-        result(std::move(datum).extract_field("r").extract_array()) { }
+        result(std::move(datum).extract_field("r").extract_array()),
+        size(0) { }
+    Response(Protocol::Response::ResponseType type_, Protocol::Response::ErrorType error_type_,
+             Array&& result_) :
+        type(type_), error_type(error_type_), result(std::move(result_)), size(0) { }
     Error as_error();
+
+    // Parse the result, if that was deferred. See ConnectOptions::defer_parsing
+    void parse();
+
     Protocol::Response::ResponseType type;
     Protocol::Response::ErrorType error_type;
     Array result;
+
+    // The size of the response on the wire
+    size_t size;
+
+    // The JSON of the whole response, when the result has not been parsed yet
+    std::string unparsed;
+};
+
+// A resolved server address
+struct Address {
+    int family;
+    int socktype;
+    int protocol;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
 };
 
 class Token;
 class ConnectionPrivate {
 public:
     ConnectionPrivate(int sockfd)
-        : guarded_next_token(1), guarded_sockfd(sockfd), guarded_loop_active(false)
+        : next_token(1), recv_start(0), recv_end(0), uring_attached(false), reconnecting(false),
+          loop_active(false), reader_running(false), reader_failed(false),
+          guarded_sockfd(sockfd), guarded_closing(false), guarded_flushing(false)
     { }
 
+    ~ConnectionPrivate();
+
     void run_query(Query query, bool no_reply = false);
 
+    // Send the queries in a single write
+    void run_queries(Query*, size_t count);
+    void run_queries(std::vector<Query>&& queries) {
+        run_queries(queries.data(), queries.size());
+    }
+
     Response wait_for_response(uint64_t, double);
+
+    // Add a token to the cache, with the connection's prefetch window
+    void add_token(uint64_t);
+
+    // Remove a token from the cache, with the responses queued for it
+    void remove_token(uint64_t);
+
+    // Queue a response for the cursor waiting on the token. Requires the token's shard lock.
+    // Returns true if the next batch should be requested, see request_more
+    bool cache_response(uint64_t, Response&&);
+
+    // Call callback with the next response for the token, from the reader
+    // thread unless a response is already available. errback is called
+    // instead if the token or connection fails
+    void wait_for_response_async(uint64_t, std::function<void(Response&&)> callback,
+                                 std::function<void(Error&&)> errback);
+    void cancel_async(uint64_t);
+
+    // Hand all reading over to a background thread. See ConnectOptions::reader_thread
+    // Requires the state lock
+    void start_reader_thread();
+    void stop_reader_thread();
+    void reader_loop();
+
+    // Hand a response received by the reader thread to whoever waits for it
+    void deliver_response(uint64_t, Response&&);
+
+    // Fail every current and future wait after the socket could not be
+    // read or written. Only the first error is kept. Takes the state lock
+    // and the shard locks, so none of them may be held
+    void set_failed(const Error&);
+
+    // Like set_failed, and also call the errbacks of asynchronous operations
+    void fail(const Error&);
+
+    // Replace the lost socket with a new one, in the reader thread. Returns
+    // false if the connection is closed first. See ConnectOptions::reconnect
+    bool reconnect();
+
     uint64_t new_token() {
-        return guarded_next_token++;
+        return next_token.fetch_add(1, std::memory_order_relaxed);
     }
 
+    // When no thread reads responses, wake a single thread blocked in
+    // wait_for_response so that it reads for the others. Takes the shard
+    // locks, so none of them may be held
+    void wake_reader();
+
+    // Become the thread that reads responses for the others, unless one
+    // already does
+    bool claim_loop() {
+        bool active = false;
+        return !reader_running && loop_active.compare_exchange_strong(active, true);
+    }
+
+    std::atomic<uint64_t> next_token;
+
+    // Lock ordering: write lock, then read lock, then state lock, then a
+    // single shard lock
     std::mutex read_lock;
     std::mutex write_lock;
-    std::mutex cache_lock;
+    std::mutex state_lock;
+
+    // Data that has been received but not consumed yet. Requires the read lock
+    std::vector<char> recv_buffer;
+    size_t recv_start;
+    size_t recv_end;
+
+    // Set when responses are read by the shared io_uring loop. See ConnectOptions::io_uring
+    bool uring_attached;
+
+    // Where and how the connection was made, to make it again
+    std::vector<Address> addresses;
+    std::string auth_key;
+    ConnectOptions options;
+
+    // Set while the socket is being replaced. Requires the write lock
+    bool reconnecting;
+
+    BatchTuner tuner;
 
     struct TokenCache {
         bool closed = false;
         std::condition_variable cond;
         std::queue<Response> responses;
+
+        // The number of threads blocked on cond
+        size_t waiters = 0;
+
+        // Set while an asynchronous operation waits for the next response
+        std::function<void(Response&&)> callback;
+        std::function<void(Error&&)> errback;
+
+        // Flow control for streams. See Cursor::set_prefetch
+        size_t prefetch_batches = 1;
+        size_t prefetch_bytes = 0;
+        size_t queued_bytes = 0;
+
+        // Set when the server has more results and they have not been requested yet
+        bool more = false;
+
+        // The START query to send again if the connection is lost before
+        // it is answered. Only kept for read-only queries, and only when
+        // ConnectOptions::reconnect is set
+        std::string replay;
+    };
+
+    // Entries are never moved, so references to them stay valid while
+    // waiting on their cond
+    using TokenMap = std::unordered_map<uint64_t, TokenCache>;
+
+    // The cache is split by token into shards with a lock each, so that
+    // threads working on different queries do not wait for each other
+    struct TokenShard {
+        std::mutex lock;
+        TokenMap guarded_tokens;
+
+        // The tokens of the shard that have threads blocked in wait_for_response
+        std::unordered_set<uint64_t> guarded_waiting;
     };
 
-    std::map<uint64_t, TokenCache> guarded_cache;
-    uint64_t guarded_next_token;
+    static const size_t token_shards = 16;
+    TokenShard shards[token_shards];
+
+    TokenShard& shard(uint64_t token) {
+        return shards[token % token_shards];
+    }
+
+    // Call f with every token and its entry, holding the lock of one shard at a time
+    template <class F>
+    void for_each_token(F f) {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            for (auto& it : shard.guarded_tokens) {
+                f(it.first, it.second);
+            }
+        }
+    }
+
+    // Take the next queued response. Requires the token's shard lock
+    // Also sets more, see request_more
+    Response pop_response(TokenMap::iterator, bool* more);
+
+    // Whether to request the next batch of the stream now, given that the
+    // consumer is out of results if needed is true. If so, the caller must
+    // send CONTINUE once the shard lock is released. Requires the token's shard lock
+    bool request_more(TokenCache&, bool needed);
+    void continue_query(uint64_t);
+
+    // Send a CONTINUE or STOP. Frames queued while another thread is
+    // sending are sent together, with a single system call, by that thread
+    // before it returns. Errors are only reported to the thread that sends
+    void send_control(Query&&);
+
+    // Set while a thread in wait_for_response reads for the others
+    std::atomic<bool> loop_active;
+
+    // Set once a reader thread or the io_uring loop reads all responses
+    std::atomic<bool> reader_running;
+    std::thread reader_thread;
+
+    // Set once the connection is unusable, see set_failed. The error is
+    // written before, and never changes after
+    std::atomic<bool> reader_failed;
+    Error reader_error;
+
+    // The fields below require the state lock
     int guarded_sockfd;
-    bool guarded_loop_active;
+
+    // Set by Connection::close and stop_reader_thread, to stop reconnecting
+    bool guarded_closing;
+    std::condition_variable reconnect_cond;
+
+    // CONTINUE and STOP frames waiting to be sent by send_control, and
+    // whether a thread is sending them. Lock ordering: write lock, then
+    // outbox lock
+    std::mutex outbox_lock;
+    std::vector<std::string> guarded_outbox;
+    bool guarded_flushing;
 };
 
-class CacheLock {
+// A host of the form unix:<path> resolves to a Unix domain socket
+std::vector<Address> resolve(const std::string& host, int port);
+
+// Connect to the first reachable address and perform the handshake
+std::unique_ptr<ConnectionPrivate> open_connection(const std::vector<Address>&,
+                                                   const std::string& auth_key,
+                                                   const ConnectOptions&);
+
+class StateLock {
 public:
-    CacheLock(ConnectionPrivate* conn) : inner_lock(conn->cache_lock) { }
+    StateLock(ConnectionPrivate* conn) : inner_lock(conn->state_lock) { }
 
     void lock() {
         inner_lock.lock();
@@ -102,16 +316,52 @@ public:
     std::unique_lock<std::mutex> inner_lock;
 };
 
+// Locks the shard of the cache that holds the token
+class TokenLock {
+public:
+    TokenLock(ConnectionPrivate* conn, uint64_t token)
+        : shard(conn->shard(token)), inner_lock(shard.lock) { }
+
+    void lock() {
+        inner_lock.lock();
+    }
+
+    void unlock() {
+        inner_lock.unlock();
+    }
+
+    ConnectionPrivate::TokenShard& shard;
+    std::unique_lock<std::mutex> inner_lock;
+};
+
 class ReadLock {
 public:
     ReadLock(ConnectionPrivate* conn_) : lock(conn_->read_lock), conn(conn_) { }
 
-    size_t recv_some(char*, size_t, double wait);
-    void recv(char*, size_t, double wait);
+    // Reads that do not complete before the deadline throw TimeoutException
+    size_t recv_some(char*, size_t, Clock::time_point deadline);
+
+    // Receive until at least size bytes are buffered, reading as much as is
+    // available each time. There is always room for one more byte after them
+    void fill(size_t size, Clock::time_point deadline);
+    void make_room(size_t size);
+    char* buffered_data() { return conn->recv_buffer.data() + conn->recv_start; }
+    size_t buffered_size() const { return conn->recv_end - conn->recv_start; }
+    void consume(size_t);
+
+    void recv(char*, size_t, Clock::time_point deadline);
     std::string recv(size_t);
-    size_t recv_cstring(char*, size_t);
+    size_t recv_cstring(char*, size_t, Clock::time_point deadline);
+
+    // Read a single response and the token it belongs to
+    Response recv_response(uint64_t*, Clock::time_point deadline);
 
-    Response read_loop(uint64_t, CacheLock&&, double);
+    // Whether a whole response is buffered, so that recv_response will not block
+    bool has_response() const;
+
+    // Read responses until the one for the token arrives, queueing the
+    // others. Requires loop_active to be set, see claim_loop
+    Response read_loop(uint64_t, Clock::time_point deadline);
 
     std::lock_guard<std::mutex> lock;
     ConnectionPrivate* conn;
@@ -124,6 +374,9 @@ public:
     void send(const char*, size_t);
     void send(std::string);
 
+    // Send the frames with as few system calls as possible
+    void send(const std::vector<std::string>&);
+
     std::lock_guard<std::mutex> lock;
     ConnectionPrivate* conn;
 };
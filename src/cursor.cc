@@ -1,6 +1,8 @@
 #include "cursor.h"
 #include "cursor_p.h"
 #include "exceptions.h"
+#include "json_p.h"
+#include "view_p.h"
 
 namespace RethinkDB {
 
@@ -22,7 +24,11 @@ Cursor::Cursor(CursorPrivate *dd) : d(dd) {}
 
 Cursor::~Cursor() {
     if (d && d->conn) {
-        close();
+        try {
+            close();
+        } catch (const Error&) {
+            // The connection was lost, and the query with it
+        }
     }
 }
 
@@ -74,7 +80,11 @@ void CursorPrivate::clear_and_read_all() const {
         index = 0;
     }
     while (!no_more) {
-        add_response(conn->d->wait_for_response(token, FOREVER));
+        add_response(wait_for_response(FOREVER));
+    }
+    if (shape) {
+        // The results are all handed over at once
+        report_tuning(true);
     }
 }
 
@@ -115,7 +125,119 @@ Datum Cursor::to_datum() && {
     return ret;
 }
 
+std::future<Array> Cursor::next_batch_async() const {
+    std::shared_ptr<std::promise<Array>> promise(new std::promise<Array>);
+    next_batch_async([promise](Array&& batch) {
+        promise->set_value(std::move(batch));
+    }, [promise](Error&& error) {
+        promise->set_exception(std::make_exception_ptr(std::move(error)));
+    });
+    return promise->get_future();
+}
+
+void Cursor::next_batch_async(std::function<void(Array&&)> callback,
+                              std::function<void(Error&&)> errback) const {
+    if (d->single) {
+        d->convert_single();
+    }
+    d->fetch_async(std::move(callback), std::move(errback));
+}
+
+Array CursorPrivate::take_buffer() const {
+    Array batch;
+    if (index == 0) {
+        batch.swap(buffer);
+    } else {
+        batch.reserve(buffer.size() - index);
+        for (size_t i = index; i < buffer.size(); ++i) {
+            batch.emplace_back(std::move(buffer[i]));
+        }
+        buffer.clear();
+    }
+    index = 0;
+    return batch;
+}
+
+void CursorPrivate::fetch_async(std::function<void(Array&&)> callback,
+                                std::function<void(Error&&)> errback) const {
+    if (index < buffer.size() || no_more) {
+        callback(take_buffer());
+        return;
+    }
+
+    conn->d->wait_for_response_async(token, [this, callback, errback](Response&& response) {
+        try {
+            add_response(std::move(response));
+        } catch (Error& error) {
+            errback(std::move(error));
+            return;
+        }
+        // Empty partial batches are skipped
+        fetch_async(callback, errback);
+    }, errback);
+}
+
+DatumView Cursor::next_batch_view(double wait) const {
+    if (d->single) {
+        d->convert_single();
+    }
+    while (d->index >= d->buffer.size() && !d->no_more) {
+        Response response = d->wait_for_response(wait);
+        if (!response.unparsed.empty()) {
+            return d->add_response_view(std::move(response));
+        }
+        d->add_response(std::move(response));
+    }
+    return read_view(write_datum(d->take_buffer()));
+}
+
+void Cursor::set_prefetch(size_t batches, size_t bytes) const {
+    ConnectionPrivate* conn = d->conn->d.get();
+    bool more;
+    {
+        TokenLock guard(conn, d->token);
+        auto it = guard.shard.guarded_tokens.find(d->token);
+        if (it == guard.shard.guarded_tokens.end()) {
+            return;
+        }
+        it->second.prefetch_batches = batches;
+        it->second.prefetch_bytes = bytes;
+        more = conn->request_more(it->second, false);
+    }
+    if (more) {
+        conn->continue_query(d->token);
+    }
+}
+
+Response CursorPrivate::wait_for_response(double wait) const {
+    if (!shape) {
+        return conn->d->wait_for_response(token, wait);
+    }
+    Clock::time_point start = Clock::now();
+    try {
+        Response response = conn->d->wait_for_response(token, wait);
+        waited += Clock::now() - start;
+        return response;
+    } catch (...) {
+        waited += Clock::now() - start;
+        throw;
+    }
+}
+
+void CursorPrivate::report_tuning(bool all_read) const {
+    size_t unread = all_read ? 0 : buffer.size() - std::min(index, buffer.size());
+    bool exhausted = no_more && unread == 0;
+    double lifetime = std::chrono::duration<double>(Clock::now() - started).count();
+    double wait_fraction = lifetime > 0 ? std::chrono::duration<double>(waited).count() / lifetime : 0;
+    conn->d->tuner.record(shape, rows - unread, batches, exhausted, wait_fraction);
+    shape = 0;
+}
+
 void Cursor::close() const {
+    if (d->shape) {
+        d->report_tuning(false);
+    }
+    d->conn->d->cancel_async(d->token);
     d->conn->stop_query(d->token);
     d->no_more = true;
 }
@@ -130,7 +252,7 @@ bool Cursor::has_next(double wait) const {
             if (d->no_more) {
                 return false;
             }
-            d->add_response(d->conn->d->wait_for_response(d->token, wait));
+            d->add_response(d->wait_for_response(wait));
         } else {
             return true;
         }
@@ -154,16 +276,20 @@ void CursorPrivate::add_results(Array&& results) const {
 
 void CursorPrivate::add_response(Response&& response) const {
     using RT = Protocol::Response::ResponseType;
+    response.parse();
+    rows += response.result.size();
+    ++batches;
     switch (response.type) {
     case RT::SUCCESS_SEQUENCE:
         add_results(std::move(response.result));
         no_more = true;
         break;
     case RT::SUCCESS_PARTIAL:
-        conn->continue_query(token);
         add_results(std::move(response.result));
         break;
     case RT::SUCCESS_ATOM:
+        // Batches only matter for streams
+        shape = 0;
         add_results(std::move(response.result));
         single = true;
         no_more = true;
@@ -182,6 +308,36 @@ void CursorPrivate::add_response(Response&& response) const {
     }
 }
 
+DatumView CursorPrivate::add_response_view(Response&& response) const {
+    using RT = Protocol::Response::ResponseType;
+    DatumView result = read_view(std::move(response.unparsed)).get_field("r");
+    if (!result.is_array()) {
+        throw Error("Invalid response from the server");
+    }
+    ++batches;
+    switch (response.type) {
+    case RT::SUCCESS_SEQUENCE:
+        no_more = true;
+        break;
+    case RT::SUCCESS_ATOM:
+        // As with convert_single
+        shape = 0;
+        no_more = true;
+        if (result.size() != 1) {
+            throw Error("Cursor: invalid response from server");
+        }
+        result = result.get_nth(0);
+        if (!result.is_array()) {
+            throw Error("Cursor: not an array");
+        }
+        break;
+    default:
+        break;
+    }
+    rows += result.size();
+    return result;
+}
+
 Cursor::iterator Cursor::begin() {
     return iterator(this);
 }
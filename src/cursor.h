@@ -1,6 +1,9 @@
 #pragma once
 
+#include <future>
+
 #include "connection.h"
+#include "view.h"
 
 namespace RethinkDB {
 
@@ -54,6 +57,33 @@ public:
     // Efficiently consume and return all elements
     Array to_array() const &;
 
+    // Asynchronously consume the elements that have already been received
+    // or, if there are none, the next batch. The future becomes ready, or
+    // the callback is called from the connection's reader thread, once the
+    // batch is available. An empty batch means the cursor is exhausted.
+    // The cursor must not be used until the operation completes. As with
+    // Term::run_async, the callback must not wait for other queries of
+    // the connection.
+    std::future<Array> next_batch_async() const;
+    void next_batch_async(std::function<void(Array&&)> callback,
+                          std::function<void(Error&&)> errback) const;
+
+    // Consume the elements that have already been received or, if there
+    // are none, the next batch, and return a view of them as an array. An
+    // empty array means the cursor is exhausted. With
+    // ConnectOptions::defer_parsing, the view is of the response as it was
+    // received, and no datum is built. Otherwise, and for elements that
+    // were already read into the cursor, it is of a copy of their JSON.
+    DatumView next_batch_view(double wait = FOREVER) const;
+
+    // Limit how far ahead of the consumer the results of a stream are
+    // fetched. Up to the given number of batches, and about the given
+    // number of bytes unless it is 0, are received and kept until they
+    // are consumed. With 0 batches, the next batch is only requested once
+    // the cursor runs out. Defaults to ConnectOptions::prefetch_batches
+    // and prefetch_bytes.
+    void set_prefetch(size_t batches, size_t bytes = 0) const;
+
     // Close the cursor
     void close() const;
 
@@ -11,15 +11,29 @@ public:
     CursorPrivate(uint64_t token, Connection *conn, Datum&&);
 
     void add_response(Response&&) const;
+    DatumView add_response_view(Response&&) const;
     void add_results(Array&&) const;
     void clear_and_read_all() const;
     void convert_single() const;
+    Array take_buffer() const;
+    void fetch_async(std::function<void(Array&&)>, std::function<void(Error&&)>) const;
+    Response wait_for_response(double wait) const;
+
+    // Report how the cursor was consumed to the batch tuner
+    void report_tuning(bool all_read) const;
 
     mutable bool single = false;
     mutable bool no_more = false;
     mutable size_t index = 0;
     mutable Array buffer;
 
+    // Statistics for ConnectOptions::tune_batches, when shape is not 0
+    mutable uint64_t shape = 0;
+    mutable Clock::time_point started;
+    mutable Clock::duration waited = Clock::duration::zero();
+    mutable size_t rows = 0;
+    mutable size_t batches = 0;
+
     uint64_t token;
     Connection *conn;
 };
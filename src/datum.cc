@@ -14,6 +14,22 @@ namespace RethinkDB {
 
 using TT = Protocol::Term::TermType;
 
+static_assert(sizeof(Datum) <= 16, "Datum is a type tag and a single word");
+
+bool number_as_integer(double d, int64_t *i_out);
+
+void Datum::datum_value::destroy_pointer(Type type) {
+    switch(type){
+    case Type::LARGE_INTEGER: delete large_integer; break;
+    case Type::STRING: delete string; break;
+    case Type::OBJECT: delete object; break;
+    case Type::ARRAY: delete array; break;
+    case Type::BINARY: delete binary; break;
+    case Type::TIME: delete time; break;
+    default: break;
+    }
+}
+
 bool Datum::is_nil() const {
     return type == Type::NIL;
 }
@@ -23,7 +39,11 @@ bool Datum::is_boolean() const {
 }
 
 bool Datum::is_number() const {
-    return type == Type::NUMBER;
+    return type == Type::NUMBER || type == Type::INTEGER || type == Type::LARGE_INTEGER;
+}
+
+bool Datum::is_integer() const {
+    return type == Type::INTEGER || type == Type::LARGE_INTEGER;
 }
 
 bool Datum::is_string() const {
@@ -63,6 +83,12 @@ const bool* Datum::get_boolean() const {
 }
 
 double* Datum::get_number() {
+    if (type == Type::LARGE_INTEGER) {
+        // Reading must not lose the exact value
+        return &value.large_integer->number;
+    } else if (type == Type::INTEGER) {
+        type = Type::NUMBER;
+    }
     if (type == Type::NUMBER) {
         return &value.number;
     } else {
@@ -71,8 +97,10 @@ double* Datum::get_number() {
 }
 
 const double* Datum::get_number() const {
-    if (type == Type::NUMBER) {
+    if (type == Type::NUMBER || type == Type::INTEGER) {
         return &value.number;
+    } else if (type == Type::LARGE_INTEGER) {
+        return &value.large_integer->number;
     } else {
         return NULL;
     }
@@ -80,7 +108,7 @@ const double* Datum::get_number() const {
 
 std::string* Datum::get_string() {
     if (type == Type::STRING) {
-        return &value.string;
+        return value.string;
     } else {
         return NULL;
     }
@@ -88,7 +116,7 @@ std::string* Datum::get_string() {
 
 const std::string* Datum::get_string() const {
     if (type == Type::STRING) {
-        return &value.string;
+        return value.string;
     } else {
         return NULL;
     }
@@ -98,8 +126,8 @@ Datum* Datum::get_field(std::string key) {
     if (type != Type::OBJECT) {
         return NULL;
     }
-    auto it = value.object.find(key);
-    if (it == value.object.end()) {
+    auto it = value.object->find(key);
+    if (it == value.object->end()) {
         return NULL;
     }
     return &it->second;
@@ -109,8 +137,8 @@ const Datum* Datum::get_field(std::string key) const {
     if (type != Type::OBJECT) {
         return NULL;
     }
-    auto it = value.object.find(key);
-    if (it == value.object.end()) {
+    auto it = value.object->find(key);
+    if (it == value.object->end()) {
         return NULL;
     }
     return &it->second;
@@ -120,25 +148,25 @@ Datum* Datum::get_nth(size_t i) {
     if (type != Type::ARRAY) {
         return NULL;
     }
-    if (i >= value.array.size()) {
+    if (i >= value.array->size()) {
         return NULL;
     }
-    return &value.array[i];
+    return &(*value.array)[i];
 }
 
 const Datum* Datum::get_nth(size_t i) const {
     if (type != Type::ARRAY) {
         return NULL;
     }
-    if (i >= value.array.size()) {
+    if (i >= value.array->size()) {
         return NULL;
     }
-    return &value.array[i];
+    return &(*value.array)[i];
 }
 
 Object* Datum::get_object() {
     if (type == Type::OBJECT) {
-        return &value.object;
+        return value.object;
     } else {
         return NULL;
     }
@@ -146,7 +174,7 @@ Object* Datum::get_object() {
 
 const Object* Datum::get_object() const {
     if (type == Type::OBJECT) {
-        return &value.object;
+        return value.object;
     } else {
         return NULL;
     }
@@ -154,7 +182,7 @@ const Object* Datum::get_object() const {
 
 Array* Datum::get_array() {
     if (type == Type::ARRAY) {
-        return &value.array;
+        return value.array;
     } else {
         return NULL;
     }
@@ -162,7 +190,7 @@ Array* Datum::get_array() {
 
 const Array* Datum::get_array() const {
     if (type == Type::ARRAY) {
-        return &value.array;
+        return value.array;
     } else {
         return NULL;
     }
@@ -170,7 +198,7 @@ const Array* Datum::get_array() const {
 
 Binary* Datum::get_binary() {
     if (type == Type::BINARY) {
-        return &value.binary;
+        return value.binary;
     } else {
         return NULL;
     }
@@ -178,7 +206,7 @@ Binary* Datum::get_binary() {
 
 const Binary* Datum::get_binary() const {
     if (type == Type::BINARY) {
-        return &value.binary;
+        return value.binary;
     } else {
         return NULL;
     }
@@ -186,7 +214,7 @@ const Binary* Datum::get_binary() const {
 
 Time* Datum::get_time() {
     if (type == Type::TIME) {
-        return &value.time;
+        return value.time;
     } else {
         return NULL;
     }
@@ -194,7 +222,7 @@ Time* Datum::get_time() {
 
 const Time* Datum::get_time() const {
     if (type == Type::TIME) {
-        return &value.time;
+        return value.time;
     } else {
         return NULL;
     }
@@ -208,32 +236,43 @@ bool& Datum::extract_boolean() {
 }
 
 double& Datum::extract_number() {
-    if (type != Type::NUMBER) {
+    double* number = get_number();
+    if (!number) {
         throw Error("extract_number: Not a number: %s", write_datum(*this).c_str());
     }
-    return value.number;
+    return *number;
+}
+
+int64_t Datum::extract_integer() const {
+    int64_t exact;
+    if (is_integer()) {
+        return integer();
+    } else if (type == Type::NUMBER && number_as_integer(value.number, &exact)) {
+        return exact;
+    }
+    throw Error("extract_integer: Not an integer: %s", write_datum(*this).c_str());
 }
 
 std::string& Datum::extract_string() {
     if (type != Type::STRING) {
         throw Error("extract_string: Not a string");
     }
-    return value.string;
+    return *value.string;
 }
 
 Object& Datum::extract_object() {
     if (type != Type::OBJECT) {
         throw Error("extract_object: Not an object");
     }
-    return value.object;
+    return *value.object;
 }
 
 Datum& Datum::extract_field(std::string key) {
     if (type != Type::OBJECT) {
         throw Error("extract_field: Not an object");
     }
-    auto it = value.object.find(key);
-    if (it == value.object.end()) {
+    auto it = value.object->find(key);
+    if (it == value.object->end()) {
         throw Error("extract_field: No such key in object");
     }
     return it->second;
@@ -243,31 +282,31 @@ Datum& Datum::extract_nth(size_t i) {
     if (type != Type::ARRAY) {
         throw Error("extract_nth: Not an array");
     }
-    if (i >= value.array.size()) {
+    if (i >= value.array->size()) {
         throw Error("extract_nth: index too large");
     }
-    return value.array[i];
+    return (*value.array)[i];
 }
 
 Array& Datum::extract_array() {
     if (type != Type::ARRAY) {
         throw Error("get_array: Not an array");
     }
-    return value.array;
+    return *value.array;
 }
 
 Binary& Datum::extract_binary() {
     if (type != Type::BINARY) {
         throw Error("get_binary: Not a binary");
     }
-    return value.binary;
+    return *value.binary;
 }
 
 Time& Datum::extract_time() {
     if (type != Type::TIME) {
         throw Error("get_time: Not a time");
     }
-    return value.time;
+    return *value.time;
 }
 
 int Datum::compare(const Datum& other) const {
@@ -276,36 +315,45 @@ int Datum::compare(const Datum& other) const {
     if (a > b) { return 1; } } while(0)
 #define COMPARE_OTHER(x) COMPARE(x, other.x)
 
+    // Integers are numbers, and are equal to the same double
+    if (is_integer() && other.is_integer()) {
+        COMPARE(integer(), other.integer());
+        return 0;
+    }
+    if (is_number() && other.is_number()) {
+        COMPARE(as_double(), other.as_double());
+        return 0;
+    }
+
     COMPARE_OTHER(type);
     int c;
     switch (type) {
     case Type::NIL: case Type::INVALID: break;
     case Type::BOOLEAN: COMPARE_OTHER(value.boolean); break;
-    case Type::NUMBER: COMPARE_OTHER(value.number); break;
     case Type::STRING:
-        c = value.string.compare(other.value.string);
+        c = value.string->compare(*other.value.string);
         COMPARE(c, 0);
         break;
     case Type::BINARY:
-        c = value.binary.data.compare(other.value.binary.data);
+        c = value.binary->data.compare(other.value.binary->data);
         COMPARE(c, 0);
         break;
     case Type::TIME:
-        COMPARE(value.time.epoch_time, other.value.time.epoch_time);
-        COMPARE(value.time.utc_offset, other.value.time.utc_offset);
+        COMPARE(value.time->epoch_time, other.value.time->epoch_time);
+        COMPARE(value.time->utc_offset, other.value.time->utc_offset);
         break;
     case Type::ARRAY:
-        COMPARE_OTHER(value.array.size());
-        for (size_t i = 0; i < value.array.size(); i++) {
-            c = value.array[i].compare(other.value.array[i]);
+        COMPARE_OTHER(value.array->size());
+        for (size_t i = 0; i < value.array->size(); i++) {
+            c = (*value.array)[i].compare((*other.value.array)[i]);
             COMPARE(c, 0);
         }
         break;
     case Type::OBJECT:
-        COMPARE_OTHER(value.object.size());
-        for (Object::const_iterator l = value.object.begin(),
-                 r = other.value.object.begin();
-             l != value.object.end();
+        COMPARE_OTHER(value.object->size());
+        for (Object::const_iterator l = value.object->begin(),
+                 r = other.value.object->begin();
+             l != value.object->end();
              ++l, ++r) {
             COMPARE(l->first, r->first);
             c = l->second.compare(r->second);
@@ -324,35 +372,46 @@ bool Datum::operator== (const Datum& other) const {
     return compare(other) == 0;
 }
 
+bool read_pseudo_type(const Object& object, Datum* out) {
+    auto field = [&object](const char* name) -> const Datum* {
+        auto it = object.find(name);
+        return it == object.end() ? nullptr : &it->second;
+    };
+    const Datum* type_field = field("$reql_type$");
+    if (!type_field) return false;
+    const std::string* type = type_field->get_string();
+    if (!type) return false;
+    if (*type == "BINARY") {
+        const Datum* data_field = field("data");
+        if (!data_field) return false;
+        const std::string* encoded_data = data_field->get_string();
+        if (!encoded_data) return false;
+        Binary binary("");
+        if (!base64_decode(*encoded_data, binary.data)) return false;
+        *out = std::move(binary);
+        return true;
+    } else if (*type == "TIME") {
+        const Datum* epoch_field = field("epoch_time");
+        if (!epoch_field) return false;
+        const Datum* tz_field = field("timezone");
+        if (!tz_field) return false;
+        const double* epoch_time = epoch_field->get_number();
+        if (!epoch_time) return false;
+        const std::string* tz  = tz_field->get_string();
+        if (!tz) return false;
+        double offset;
+        if (!Time::parse_utc_offset(*tz, &offset)) return false;
+        *out = Time(*epoch_time, offset);
+        return true;
+    }
+    return false;
+}
+
 Datum Datum::from_raw() const {
-    do {
-        const Datum* type_field = get_field("$reql_type$");
-        if (!type_field) break;
-        const std::string* type = type_field->get_string();
-        if (!type) break;;
-        if (!strcmp(type->c_str(), "BINARY")) {
-            const Datum* data_field = get_field("data");
-            if (!data_field) break;
-            const std::string* encoded_data = data_field->get_string();
-            if (!encoded_data) break;
-            Binary binary("");
-            if (base64_decode(*encoded_data, binary.data)) {
-                return binary;
-            }
-        } else if (!strcmp(type->c_str(), "TIME")) {
-            const Datum* epoch_field = get_field("epoch_time");
-            if (!epoch_field) break;
-            const Datum* tz_field = get_field("timezone");
-            if (!tz_field) break;
-            const double* epoch_time = epoch_field->get_number();
-            if (!epoch_time) break;
-            const std::string* tz  = tz_field->get_string();
-            if (!tz) break;
-            double offset;
-            if (!Time::parse_utc_offset(*tz, &offset)) break;
-            return Time(*epoch_time, offset);
-        }
-    } while (0);
+    Datum datum;
+    if (type == Type::OBJECT && read_pseudo_type(*value.object, &datum)) {
+        return datum;
+    }
     return *this;
 }
 
@@ -360,12 +419,12 @@ Datum Datum::to_raw() const {
     if (type == Type::BINARY) {
         return Object{
             {"$reql_type$", "BINARY"},
-            {"data", base64_encode(value.binary.data)}};
+            {"data", base64_encode(value.binary->data)}};
     } else if (type == Type::TIME) {
         return Object{
             {"$reql_type$", "TIME"},
-            {"epoch_time", value.time.epoch_time},
-            {"timezone", Time::utc_offset_string(value.time.utc_offset)}};
+            {"epoch_time", value.time->epoch_time},
+            {"timezone", Time::utc_offset_string(value.time->utc_offset)}};
     }
     return *this;
 }
@@ -388,58 +447,100 @@ bool number_as_integer(double d, int64_t *i_out) {
     return false;
 }
 
+// A rapidjson output stream that appends to a string
+struct StringOutput {
+    typedef char Ch;
+
+    void Put(char c) { out->push_back(c); }
+    void Flush() { }
+
+    std::string* out;
+};
+
 template void Datum::write_json(
     rapidjson::Writer<rapidjson::StringBuffer> *writer) const;
 template void Datum::write_json(
     rapidjson::PrettyWriter<rapidjson::StringBuffer> *writer) const;
+template void Datum::write_json(
+    rapidjson::Writer<StringOutput> *writer) const;
+
+template <class json_writer_t>
+static void write_number(json_writer_t *writer, double d) {
+    // Always print -0.0 as a double since integers cannot represent -0.
+    // Otherwise check if the number is an integer and print it as such.
+    int64_t i;
+    if (!(d == 0.0 && std::signbit(d)) && number_as_integer(d, &i)) {
+        writer->Int64(i);
+    } else {
+        writer->Double(d);
+    }
+}
 
 template <class json_writer_t>
 void Datum::write_json(json_writer_t *writer) const {
     switch (type) {
     case Type::NIL: writer->Null(); break;
     case Type::BOOLEAN: writer->Bool(value.boolean); break;
-    case Type::NUMBER: {
-        const double d = value.number;
-        // Always print -0.0 as a double since integers cannot represent -0.
-        // Otherwise check if the number is an integer and print it as such.
-        int64_t i;
-        if (!(d == 0.0 && std::signbit(d)) && number_as_integer(d, &i)) {
-            writer->Int64(i);
-        } else {
-            writer->Double(d);
-        }
-    } break;
-    case Type::STRING: writer->String(value.string.data(), value.string.size()); break;
+    case Type::NUMBER: write_number(writer, value.number); break;
+    case Type::INTEGER: case Type::LARGE_INTEGER: writer->Int64(integer()); break;
+    case Type::STRING: writer->String(value.string->data(), value.string->size()); break;
     case Type::ARRAY: {
         writer->StartArray();
-        for (auto it : value.array) {
+        for (const auto& it : *value.array) {
             it.write_json(writer);
         }
         writer->EndArray();
     } break;
     case Type::OBJECT: {
         writer->StartObject();
-        for (auto it : value.object) {
+        for (const auto& it : *value.object) {
             writer->Key(it.first.data(), it.first.size());
             it.second.write_json(writer);
         }
         writer->EndObject();
     } break;
 
-    case Type::BINARY:
-    case Type::TIME:
-        to_raw().write_json(writer);
-        break;
+    // Written as the objects that to_raw() returns, without building them
+    case Type::BINARY: {
+        // Encoded into a buffer that is reused by the next binary
+        static thread_local std::string encoded;
+        encoded.clear();
+        base64_encode(value.binary->data, encoded);
+        writer->StartObject();
+        writer->Key("$reql_type$");
+        writer->String("BINARY");
+        writer->Key("data");
+        writer->String(encoded.data(), encoded.size());
+        writer->EndObject();
+    } break;
+    case Type::TIME: {
+        writer->StartObject();
+        writer->Key("$reql_type$");
+        writer->String("TIME");
+        writer->Key("epoch_time");
+        write_number(writer, value.time->epoch_time);
+        writer->Key("timezone");
+        std::string timezone = Time::utc_offset_string(value.time->utc_offset);
+        writer->String(timezone.data(), timezone.size());
+        writer->EndObject();
+    } break;
     default:
         throw Error("cannot write invalid datum");
     }
 }
 
-std::string Datum::as_json() const {
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+void Datum::append_json(std::string* out) const {
+    // The writer keeps the stack it uses for nesting from one call to the next
+    static thread_local rapidjson::Writer<StringOutput> writer;
+    StringOutput output{out};
+    writer.Reset(output);
     write_json(&writer);
-    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+std::string Datum::as_json() const {
+    std::string out;
+    append_json(&out);
+    return out;
 }
 
 Datum Datum::from_json(const std::string& json) {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
@@ -17,7 +18,7 @@ class Cursor;
 // The following JSON types are represented in a Datum as
 //  * null -> Nil
 //  * boolean -> bool
-//  * number -> double
+//  * number -> double, or int64_t for integers
 //  * unicode strings -> std::string
 //  * array -> Array (aka std::vector<Datum>
 //  * object -> Object (aka std::map<std::string, Datum>>
@@ -27,44 +28,65 @@ class Cursor;
 //  * points. lines and polygons -> not implemented
 class Datum {
 public:
-    Datum() : type(Type::INVALID), value() {}
-    Datum(Nil) : type(Type::NIL), value() { }
-    Datum(bool boolean_) : type(Type::BOOLEAN), value(boolean_) { }
-    Datum(double number_) : type(Type::NUMBER), value(number_) { }
-    Datum(const std::string& string_) : type(Type::STRING), value(string_) { }
-    Datum(std::string&& string_) : type(Type::STRING), value(std::move(string_)) { }
-    Datum(const Array& array_) : type(Type::ARRAY), value(array_) { }
-    Datum(Array&& array_) : type(Type::ARRAY), value(std::move(array_)) { }
-    Datum(const Binary& binary) : type(Type::BINARY), value(binary) { }
-    Datum(Binary&& binary) : type(Type::BINARY), value(std::move(binary)) { }
-    Datum(const Time time) : type(Type::TIME), value(time) { }
-    Datum(const Object& object_) : type(Type::OBJECT), value(object_) { }
-    Datum(Object&& object_) : type(Type::OBJECT), value(std::move(object_)) { }
-    Datum(const Datum& other) : type(other.type), value(other.type, other.value) { }
-    Datum(Datum&& other) : type(other.type), value(other.type, std::move(other.value)) { }
+    Datum() : type(Type::INVALID) { value.pointer = nullptr; }
+    Datum(Nil) : type(Type::NIL) { value.pointer = nullptr; }
+    Datum(bool boolean_) : type(Type::BOOLEAN) { value.boolean = boolean_; }
+    Datum(double number_) : type(Type::NUMBER) { value.number = number_; }
+    Datum(const std::string& string_) : type(Type::STRING) { value.string = new std::string(string_); }
+    Datum(std::string&& string_) : type(Type::STRING) { value.string = new std::string(std::move(string_)); }
+    Datum(const Array& array_) : type(Type::ARRAY) { value.array = new Array(array_); }
+    Datum(Array&& array_) : type(Type::ARRAY) { value.array = new Array(std::move(array_)); }
+    Datum(const Binary& binary) : type(Type::BINARY) { value.binary = new Binary(binary); }
+    Datum(Binary&& binary) : type(Type::BINARY) { value.binary = new Binary(std::move(binary)); }
+    Datum(const Time time) : type(Type::TIME) { value.time = new Time(time); }
+    Datum(const Object& object_) : type(Type::OBJECT) { value.object = new Object(object_); }
+    Datum(Object&& object_) : type(Type::OBJECT) { value.object = new Object(std::move(object_)); }
+    Datum(const Datum& other) : type(other.type) { value.copy(type, other.value); }
+    // Moves do not throw, so that containers move datums instead of copying them when they grow.
+    // A datum that has been moved from is nil
+    Datum(Datum&& other) noexcept : type(other.type), value(other.value) {
+        other.type = Type::NIL;
+    }
 
     Datum& operator=(const Datum& other) {
-        value.destroy(type);
-        type = other.type;
-        value.set(type, other.value);
+        if (this != &other) {
+            datum_value copy;
+            copy.copy(other.type, other.value);
+            value.destroy(type);
+            type = other.type;
+            value = copy;
+        }
         return *this;
     }
 
-    Datum& operator=(Datum&& other) {
-        value.destroy(type);
-        type = other.type;
-        value.set(type, std::move(other.value));
+    Datum& operator=(Datum&& other) noexcept {
+        if (this != &other) {
+            value.destroy(type);
+            type = other.type;
+            value = other.value;
+            other.type = Type::NIL;
+        }
         return *this;
     }
 
-    Datum(unsigned short number_) : Datum(static_cast<double>(number_)) { }
-    Datum(signed short number_) : Datum(static_cast<double>(number_)) { }
-    Datum(unsigned int number_) : Datum(static_cast<double>(number_)) { }
-    Datum(signed int number_) : Datum(static_cast<double>(number_)) { }
-    Datum(unsigned long number_) : Datum(static_cast<double>(number_)) { }
-    Datum(signed long number_) : Datum(static_cast<double>(number_)) { }
-    Datum(unsigned long long number_) : Datum(static_cast<double>(number_)) { }
-    Datum(signed long long number_) : Datum(static_cast<double>(number_)) { }
+    // Integers are stored exactly, unless they are too large for an int64_t
+    Datum(signed long long number_) : type(Type::INTEGER) {
+        if (-max_inline_integer <= number_ && number_ <= max_inline_integer) {
+            value.number = static_cast<double>(number_);
+        } else {
+            type = Type::LARGE_INTEGER;
+            value.large_integer = new large_integer_value{number_, static_cast<double>(number_)};
+        }
+    }
+    Datum(unsigned long long number_)
+        : Datum(number_ > INT64_MAX ? Datum(static_cast<double>(number_))
+                                    : Datum(static_cast<signed long long>(number_))) { }
+    Datum(unsigned short number_) : Datum(static_cast<signed long long>(number_)) { }
+    Datum(signed short number_) : Datum(static_cast<signed long long>(number_)) { }
+    Datum(unsigned int number_) : Datum(static_cast<signed long long>(number_)) { }
+    Datum(signed int number_) : Datum(static_cast<signed long long>(number_)) { }
+    Datum(unsigned long number_) : Datum(static_cast<unsigned long long>(number_)) { }
+    Datum(signed long number_) : Datum(static_cast<signed long long>(number_)) { }
 
     Datum(Protocol::Term::TermType type) : Datum(static_cast<double>(type)) { }
     Datum(const char* string) : Datum(static_cast<std::string>(string)) { }
@@ -74,30 +96,30 @@ public:
     Datum(const Cursor&);
 
     template <class T>
-    Datum(const std::map<std::string, T>& map) : type(Type::OBJECT), value(Object()) {
+    Datum(const std::map<std::string, T>& map) : Datum(Object()) {
         for (const auto& it : map) {
-            value.object.emplace(it.left, Datum(it.right));
+            value.object->emplace(it.left, Datum(it.right));
         }
     }
 
     template <class T>
-    Datum(std::map<std::string, T>&& map) : type(Type::OBJECT), value(Object()) {
+    Datum(std::map<std::string, T>&& map) : Datum(Object()) {
         for (auto& it : map) {
-            value.object.emplace(it.first, Datum(std::move(it.second)));
+            value.object->emplace(it.first, Datum(std::move(it.second)));
         }
     }
 
     template <class T>
-    Datum(const std::vector<T>& vec) : type(Type::ARRAY), value(Array()) {
+    Datum(const std::vector<T>& vec) : Datum(Array()) {
         for (const auto& it : vec) {
-            value.array.emplace_back(it);
+            value.array->emplace_back(it);
         }
     }
 
     template <class T>
-    Datum(std::vector<T>&& vec) : type(Type::ARRAY), value(Array()) {
+    Datum(std::vector<T>&& vec) : Datum(Array()) {
         for (auto& it : vec) {
-            value.array.emplace_back(std::move(it));
+            value.array->emplace_back(std::move(it));
         }
     }
 
@@ -112,11 +134,12 @@ public:
         case Type::NIL: return f(Nil(), std::forward<A>(args)...); break;
         case Type::BOOLEAN: return f(value.boolean, std::forward<A>(args)...); break;
         case Type::NUMBER: return f(value.number, std::forward<A>(args)...); break;
-        case Type::STRING: return f(value.string, std::forward<A>(args)...); break;
-        case Type::OBJECT: return f(value.object, std::forward<A>(args)...); break;
-        case Type::ARRAY: return f(value.array, std::forward<A>(args)...); break;
-        case Type::BINARY: return f(value.binary, std::forward<A>(args)...); break;
-        case Type::TIME: return f(value.time, std::forward<A>(args)...); break;
+        case Type::INTEGER: case Type::LARGE_INTEGER: return f(integer(), std::forward<A>(args)...); break;
+        case Type::STRING: return f(*value.string, std::forward<A>(args)...); break;
+        case Type::OBJECT: return f(*value.object, std::forward<A>(args)...); break;
+        case Type::ARRAY: return f(*value.array, std::forward<A>(args)...); break;
+        case Type::BINARY: return f(*value.binary, std::forward<A>(args)...); break;
+        case Type::TIME: return f(*value.time, std::forward<A>(args)...); break;
         default:
             throw Error("internal error: no such datum type %d", static_cast<int>(type));
         }
@@ -128,11 +151,12 @@ public:
         case Type::NIL: return f(Nil(), std::forward<A>(args)...); break;
         case Type::BOOLEAN: return f(std::move(value.boolean), std::forward<A>(args)...); break;
         case Type::NUMBER: return f(std::move(value.number), std::forward<A>(args)...); break;
-        case Type::STRING: return f(std::move(value.string), std::forward<A>(args)...); break;
-        case Type::OBJECT: return f(std::move(value.object), std::forward<A>(args)...); break;
-        case Type::ARRAY: return f(std::move(value.array), std::forward<A>(args)...); break;
-        case Type::BINARY: return f(std::move(value.binary), std::forward<A>(args)...); break;
-        case Type::TIME: return f(std::move(value.time), std::forward<A>(args)...); break;
+        case Type::INTEGER: case Type::LARGE_INTEGER: return f(integer(), std::forward<A>(args)...); break;
+        case Type::STRING: return f(std::move(*value.string), std::forward<A>(args)...); break;
+        case Type::OBJECT: return f(std::move(*value.object), std::forward<A>(args)...); break;
+        case Type::ARRAY: return f(std::move(*value.array), std::forward<A>(args)...); break;
+        case Type::BINARY: return f(std::move(*value.binary), std::forward<A>(args)...); break;
+        case Type::TIME: return f(std::move(*value.time), std::forward<A>(args)...); break;
         default:
             throw Error("internal error: no such datum type %d", static_cast<int>(type));
         }
@@ -140,7 +164,9 @@ public:
 
     bool is_nil() const;
     bool is_boolean() const;
+    // True for integers too
     bool is_number() const;
+    bool is_integer() const;
     bool is_string() const;
     bool is_object() const;
     bool is_array() const;
@@ -151,6 +177,10 @@ public:
 
     bool* get_boolean();
     const bool* get_boolean() const;
+    // The non-const get_number and extract_number turn an integer into a
+    // double, since it can then be modified through the result. Integers
+    // too large for a double stay exact: the result points to a copy of
+    // the value as a double, and writing to it does not change the datum
     double* get_number();
     const double* get_number() const;
     std::string* get_string();
@@ -172,6 +202,8 @@ public:
 
     bool& extract_boolean();
     double& extract_number();
+    // Also accepts doubles that have an integer value
+    int64_t extract_integer() const;
     std::string& extract_string();
     Object& extract_object();
     Datum& extract_field(std::string);
@@ -195,90 +227,80 @@ public:
 
     template <class json_writer_t> void write_json(json_writer_t *writer) const;
 
+    // Append the JSON representation to the string. Does not allocate
+    // unless the string has to grow
+    void append_json(std::string* out) const;
+
     std::string as_json() const;
     static Datum from_json(const std::string&);
 
     bool is_valid() const { return type != Type::INVALID; }
 
 private:
-    enum class Type {
+    enum class Type : uint8_t {
         INVALID,    // default constructed
-        ARRAY, BOOLEAN, NIL, NUMBER, OBJECT, BINARY, STRING, TIME
+        ARRAY, BOOLEAN, NIL, NUMBER, INTEGER, LARGE_INTEGER, OBJECT, BINARY, STRING, TIME
         // POINT, LINE, POLYGON
     };
     Type type;
 
-    union datum_value {
-        bool boolean;
+    // Integers up to this size are stored as doubles, which represent them exactly
+    static const long long max_inline_integer = 1LL << 53;
+
+    // Larger integers also keep their value as a double, for get_number.
+    // It is only handed out, never read back
+    struct large_integer_value {
+        int64_t integer;
         double number;
-        std::string string;
-        Object object;
-        Array array;
-        Binary binary;
-        Time time;
-
-        datum_value() { }
-        datum_value(bool boolean_) : boolean(boolean_) { }
-        datum_value(double number_) : number(number_) { }
-        datum_value(const std::string& string_) : string(string_) { }
-        datum_value(std::string&& string_) : string(std::move(string_)) { }
-        datum_value(const Object& object_) : object(object_) { }
-        datum_value(Object&& object_) : object(std::move(object_)) { }
-        datum_value(const Array& array_) : array(array_) { }
-        datum_value(Array&& array_) : array(std::move(array_)) { }
-        datum_value(const Binary& binary_) : binary(binary_) { }
-        datum_value(Binary&& binary_) : binary(std::move(binary_)) { }
-        datum_value(Time time) : time(std::move(time)) { }
-
-        datum_value(Type type, const datum_value& other){
-            set(type, other);
-        }
+    };
 
-        datum_value(Type type, datum_value&& other){
-            set(type, std::move(other));
-        }
+    int64_t integer() const {
+        return type == Type::INTEGER ? static_cast<int64_t>(value.number) : value.large_integer->integer;
+    }
 
-        void set(Type type, datum_value&& other) {
-            switch(type){
-            case Type::NIL: case Type::INVALID: break;
-            case Type::BOOLEAN: new (this) bool(other.boolean); break;
-            case Type::NUMBER: new (this) double(other.number); break;
-            case Type::STRING: new (this) std::string(std::move(other.string)); break;
-            case Type::OBJECT: new (this) Object(std::move(other.object)); break;
-            case Type::ARRAY: new (this) Array(std::move(other.array)); break;
-            case Type::BINARY: new (this) Binary(std::move(other.binary)); break;
-            case Type::TIME: new (this) Time(std::move(other.time)); break;
-            }
-        }
+    // The value of a number as a double, taken from the exact value of large integers
+    double as_double() const {
+        return type == Type::LARGE_INTEGER ? static_cast<double>(value.large_integer->integer) : value.number;
+    }
 
-        void set(Type type, const datum_value& other) {
+    // Scalars are stored inline, everything else behind a pointer. A datum
+    // is a type tag and a single word
+    union datum_value {
+        bool boolean;
+        double number;
+        large_integer_value* large_integer;
+        std::string* string;
+        Object* object;
+        Array* array;
+        Binary* binary;
+        Time* time;
+        void* pointer;
+
+        void copy(Type type, const datum_value& other) {
             switch(type){
-            case Type::NIL: case Type::INVALID: break;
-            case Type::BOOLEAN: new (this) bool(other.boolean); break;
-            case Type::NUMBER: new (this) double(other.number); break;
-            case Type::STRING: new (this) std::string(other.string); break;
-            case Type::OBJECT: new (this) Object(other.object); break;
-            case Type::ARRAY: new (this) Array(other.array); break;
-            case Type::BINARY: new (this) Binary(other.binary); break;
-            case Type::TIME: new (this) Time(other.time); break;
+            case Type::INVALID: case Type::NIL: pointer = nullptr; break;
+            case Type::BOOLEAN: boolean = other.boolean; break;
+            case Type::NUMBER: case Type::INTEGER: number = other.number; break;
+            case Type::LARGE_INTEGER: large_integer = new large_integer_value(*other.large_integer); break;
+            case Type::STRING: string = new std::string(*other.string); break;
+            case Type::OBJECT: object = new Object(*other.object); break;
+            case Type::ARRAY: array = new Array(*other.array); break;
+            case Type::BINARY: binary = new Binary(*other.binary); break;
+            case Type::TIME: time = new Time(*other.time); break;
             }
         }
 
         void destroy(Type type) {
             switch(type){
-            case Type::INVALID: break;
-            case Type::NIL: break;
-            case Type::BOOLEAN: break;
-            case Type::NUMBER: break;
-            case Type::STRING: { typedef std::string str; string.~str(); } break;
-            case Type::OBJECT: object.~Object(); break;
-            case Type::ARRAY: array.~Array(); break;
-            case Type::BINARY: binary.~Binary(); break;
-            case Type::TIME: time.~Time(); break;
+            case Type::INVALID: case Type::NIL: case Type::BOOLEAN: break;
+            case Type::NUMBER: case Type::INTEGER: break;
+            default: destroy_pointer(type); break;
             }
         }
 
-        ~datum_value() { }
+        // Out of line, since GCC warns about the deletes wherever it
+        // inlines them into code that fills containers of datums
+        void destroy_pointer(Type type);
     };
 
     datum_value value;
@@ -0,0 +1,225 @@
+#include "ingest.h"
+#include "connection_p.h"
+#include "exceptions.h"
+
+namespace RethinkDB {
+
+using QueryType = Protocol::Query::QueryType;
+
+class IngestStreamPrivate {
+public:
+    IngestStreamPrivate(ConnectionPrivate* conn_, IngestOptions&& options_)
+        : conn(conn_), options(std::move(options_)),
+          guarded_written(0), guarded_sent(0), guarded_checkpointed(0), guarded_confirmed(0),
+          guarded_last_checkpoint(Clock::now()), guarded_checkpoint_requested(false),
+          guarded_closing(false), guarded_failed(false)
+    { }
+
+    // Send queued writes and checkpoints until closed
+    void run(std::shared_ptr<IngestStreamPrivate> self);
+
+    // Whether the writes sent so far should be followed by a checkpoint
+    bool checkpoint_due(size_t sent);
+
+    void fail(const Error&);
+
+    ConnectionPrivate* conn;
+    const IngestOptions options;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<Query> guarded_pending;
+    size_t guarded_written;
+    size_t guarded_sent;
+    size_t guarded_checkpointed;
+    size_t guarded_confirmed;
+    Clock::time_point guarded_last_checkpoint;
+    bool guarded_checkpoint_requested;
+    bool guarded_closing;
+    bool guarded_failed;
+    Error guarded_error;
+
+    std::thread sender;
+};
+
+IngestStream::IngestStream(Connection& conn, IngestOptions options)
+    : d(new IngestStreamPrivate(conn.d.get(), std::move(options))) {
+    d->sender = std::thread(&IngestStreamPrivate::run, d.get(), d);
+}
+
+IngestStream::~IngestStream() {
+    try {
+        close();
+    } catch (const Error&) {
+    }
+    if (d->sender.joinable()) {
+        d->sender.join();
+    }
+}
+
+void IngestStream::write(Term&& term, OptArgs&& args) {
+    if (!term.free_vars.empty()) {
+        throw Error("write: term has free variables");
+    }
+    args.erase("noreply");
+    args.emplace("noreply", expr(true));
+
+    std::unique_lock<std::mutex> guard(d->lock);
+    while (!d->guarded_failed && !d->guarded_closing &&
+           d->guarded_pending.size() >= d->options.max_pending_writes) {
+        d->cond.wait(guard);
+    }
+    if (d->guarded_failed) {
+        throw Error(d->guarded_error);
+    }
+    if (d->guarded_closing) {
+        throw Error("write: the stream is closed");
+    }
+
+    d->guarded_pending.emplace_back(
+        Query{QueryType::START, d->conn->new_token(), std::move(term.datum), std::move(args)});
+    ++d->guarded_written;
+    d->cond.notify_all();
+}
+
+void IngestStream::flush(double wait) {
+    Clock::time_point deadline = deadline_after(wait);
+    std::unique_lock<std::mutex> guard(d->lock);
+    size_t target = d->guarded_written;
+    d->guarded_checkpoint_requested = true;
+    d->cond.notify_all();
+
+    while (!d->guarded_failed && d->guarded_confirmed < target) {
+        if (deadline == Clock::time_point::max()) {
+            d->cond.wait(guard);
+        } else if (d->cond.wait_until(guard, deadline) == std::cv_status::timeout &&
+                   !d->guarded_failed && d->guarded_confirmed < target) {
+            throw TimeoutException();
+        }
+    }
+    if (d->guarded_failed) {
+        throw Error(d->guarded_error);
+    }
+}
+
+void IngestStream::close() {
+    {
+        std::lock_guard<std::mutex> guard(d->lock);
+        if (d->guarded_closing) {
+            return;
+        }
+    }
+    try {
+        flush();
+    } catch (const Error&) {
+        std::lock_guard<std::mutex> guard(d->lock);
+        d->guarded_closing = true;
+        d->cond.notify_all();
+        throw;
+    }
+    {
+        std::lock_guard<std::mutex> guard(d->lock);
+        d->guarded_closing = true;
+        d->cond.notify_all();
+    }
+    d->sender.join();
+}
+
+size_t IngestStream::written() const {
+    std::lock_guard<std::mutex> guard(d->lock);
+    return d->guarded_written;
+}
+
+size_t IngestStream::confirmed() const {
+    std::lock_guard<std::mutex> guard(d->lock);
+    return d->guarded_confirmed;
+}
+
+bool IngestStreamPrivate::checkpoint_due(size_t sent) {
+    if (sent == guarded_checkpointed) {
+        return false;
+    }
+    return guarded_checkpoint_requested ||
+        sent - guarded_checkpointed >= options.checkpoint_writes ||
+        Clock::now() >= guarded_last_checkpoint + seconds(options.checkpoint_interval);
+}
+
+void IngestStreamPrivate::fail(const Error& error) {
+    if (!guarded_failed) {
+        guarded_failed = true;
+        guarded_error = Error(error);
+    }
+    cond.notify_all();
+}
+
+void IngestStreamPrivate::run(std::shared_ptr<IngestStreamPrivate> self) {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        while (!guarded_failed && !guarded_closing && guarded_pending.empty() &&
+               !checkpoint_due(guarded_sent)) {
+            if (guarded_sent > guarded_checkpointed) {
+                cond.wait_until(guard, guarded_last_checkpoint + seconds(options.checkpoint_interval));
+            } else {
+                cond.wait(guard);
+            }
+        }
+        if (guarded_failed || (guarded_closing && guarded_pending.empty())) {
+            return;
+        }
+
+        // Everything queued so far goes out in a single write, followed by
+        // a checkpoint if one is due
+        std::vector<Query> queries;
+        queries.swap(guarded_pending);
+        size_t sent = guarded_sent + queries.size();
+        uint64_t token = 0;
+        if (checkpoint_due(sent)) {
+            token = conn->new_token();
+            queries.emplace_back(Query{QueryType::NOREPLY_WAIT, token});
+            guarded_checkpointed = sent;
+            guarded_last_checkpoint = Clock::now();
+            guarded_checkpoint_requested = false;
+        }
+        cond.notify_all();
+        guard.unlock();
+
+        try {
+            if (token) {
+                conn->add_token(token);
+                conn->wait_for_response_async(token, [self, sent](Response&& response) {
+                    if (response.type != Protocol::Response::ResponseType::WAIT_COMPLETE) {
+                        // as_error throws the error rather than returning it
+                        try {
+                            throw response.as_error();
+                        } catch (const Error& error) {
+                            std::lock_guard<std::mutex> guard(self->lock);
+                            self->fail(error);
+                        }
+                        return;
+                    }
+                    // Report progress before waking flush(), so that it
+                    // returns after the last report
+                    if (self->options.on_progress) {
+                        self->options.on_progress(sent);
+                    }
+                    std::lock_guard<std::mutex> guard(self->lock);
+                    self->guarded_confirmed = std::max(self->guarded_confirmed, sent);
+                    self->cond.notify_all();
+                }, [self](Error&& error) {
+                    std::lock_guard<std::mutex> guard(self->lock);
+                    self->fail(error);
+                });
+            }
+            conn->run_queries(std::move(queries));
+        } catch (const Error& error) {
+            guard.lock();
+            fail(error);
+            return;
+        }
+
+        guard.lock();
+        guarded_sent = sent;
+    }
+}
+
+}
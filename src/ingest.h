@@ -0,0 +1,62 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include "connection.h"
+#include "term.h"
+
+namespace RethinkDB {
+
+// Options for IngestStream
+struct IngestOptions {
+    // Ask the server to confirm that the writes so far have been processed
+    // after this many writes, or once this long has passed since the
+    // previous confirmation, whichever comes first
+    size_t checkpoint_writes = 1000;
+    double checkpoint_interval = 0.1 * SECOND;
+
+    // write() blocks while this many writes are waiting to be sent
+    size_t max_pending_writes = 10000;
+
+    // Called from the connection's reader thread after each checkpoint,
+    // with the number of writes the server has processed so far
+    std::function<void(size_t)> on_progress;
+};
+
+// Streams noreply writes to the server as fast as the protocol allows.
+// write() only queues the write. A background thread sends everything
+// queued since its last send in a single write, without waiting for any
+// answer. Since noreply writes are never answered, progress is tracked
+// with NOREPLY_WAIT checkpoints, which the server answers once it has
+// processed every query sent before them. Errors in individual writes
+// are not reported. The stream must be closed before the connection.
+class IngestStreamPrivate;
+class IngestStream {
+public:
+    explicit IngestStream(Connection&, IngestOptions options = IngestOptions());
+    IngestStream(const IngestStream&) = delete;
+    IngestStream& operator=(const IngestStream&) = delete;
+
+    // Closes the stream, ignoring errors
+    ~IngestStream();
+
+    // Queue a write. Throws if the stream has failed
+    void write(Term&& term, OptArgs&& args = {});
+
+    // Send all queued writes and wait until the server has processed them.
+    // Throws TimeoutException after wait seconds
+    void flush(double wait = FOREVER);
+
+    // Flush, then stop the background thread
+    void close();
+
+    // The number of writes queued so far, and of those the server has processed
+    size_t written() const;
+    size_t confirmed() const;
+
+private:
+    std::shared_ptr<IngestStreamPrivate> d;
+};
+
+}
@@ -1,55 +1,184 @@
+#include <cstring>
+#include <deque>
+
 #include "json_p.h"
 #include "error.h"
 #include "utils.h"
 
 #include "rapidjson-config.h"
-#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/prettywriter.h"
 
 namespace RethinkDB {
 
+// Builds datums from the events of a rapidjson SAX reader. When reading a
+// response, the fields of the top-level object are stored in the response
+// fields instead of being collected into an Object
+class DatumBuilder : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, DatumBuilder> {
+public:
+    explicit DatumBuilder(ResponseFields* response_ = nullptr)
+        : response(response_), stack(scratch), depth(0) { }
+
+    ~DatumBuilder() {
+        // Only left over when the JSON is invalid
+        for (size_t i = 0; i < depth; ++i) {
+            stack[i].array.clear();
+            stack[i].object.clear();
+        }
+    }
+
+    bool Null() { return add(Nil()); }
+    bool Bool(bool boolean) { return add(boolean); }
+    bool Int(int number) { return add(number); }
+    bool Uint(unsigned number) { return add(number); }
+    bool Int64(int64_t number) { return add(number); }
+    bool Uint64(uint64_t number) { return add(number); }
+    bool Double(double number) { return add(number); }
+
+    bool String(const char* string, rapidjson::SizeType length, bool) {
+        return add(std::string(string, length));
+    }
+
+    bool StartObject() {
+        push(true);
+        return true;
+    }
+
+    bool Key(const char* string, rapidjson::SizeType length, bool) {
+        static const char pseudo_type_key[] = "$reql_type$";
+        Container& top = stack[depth - 1];
+        top.key.assign(string, length);
+        if (length == sizeof pseudo_type_key - 1 && !memcmp(string, pseudo_type_key, length)) {
+            top.is_pseudo_type = true;
+        }
+        return true;
+    }
+
+    bool EndObject(rapidjson::SizeType) {
+        Container& top = stack[--depth];
+        Object object(std::move(top.object));
+        top.object.clear();
+        if (response && depth == 0) {
+            return true;
+        }
+        Datum datum;
+        if (top.is_pseudo_type && read_pseudo_type(object, &datum)) {
+            return add(std::move(datum));
+        }
+        return add(std::move(object));
+    }
+
+    bool StartArray() {
+        push(false);
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType) {
+        // Copy the elements out with a single allocation, and keep the
+        // scratch array for the next array read at this depth
+        Array& elements = stack[--depth].array;
+        Array array;
+        array.reserve(elements.size());
+        for (auto& element : elements) {
+            array.emplace_back(std::move(element));
+        }
+        if (elements.capacity() > max_scratch_size) {
+            Array().swap(elements);
+        } else {
+            elements.clear();
+        }
+        return add(std::move(array));
+    }
+
+    Datum root;
+
+private:
+    struct Container {
+        bool is_object = false;
+        bool is_pseudo_type = false;
+        Array array;
+        Object object;
+        std::string key;
+    };
+
+    void push(bool is_object) {
+        if (depth == stack.size()) {
+            stack.emplace_back();
+        }
+        stack[depth].is_object = is_object;
+        stack[depth++].is_pseudo_type = false;
+    }
+
+    bool add(Datum&& value) {
+        if (depth == 0) {
+            // A response must be an object
+            if (response) {
+                return false;
+            }
+            root = std::move(value);
+            return true;
+        }
+
+        Container& top = stack[depth - 1];
+        if (!top.is_object) {
+            top.array.emplace_back(std::move(value));
+        } else if (response && depth == 1) {
+            return add_field(top.key, std::move(value));
+        } else {
+            top.object.emplace(std::move(top.key), std::move(value));
+        }
+        return true;
+    }
+
+    bool add_field(const std::string& key, Datum&& value) {
+        if (key == "t" || key == "e") {
+            const double* number = value.get_number();
+            if (!number) {
+                return false;
+            }
+            (key == "t" ? response->type : response->error_type) = *number;
+        } else if (key == "r") {
+            Array* result = value.get_array();
+            if (!result) {
+                return false;
+            }
+            response->result = std::move(*result);
+        }
+        // Other fields, such as profiles and notes, are not used
+        return true;
+    }
+
+    // Scratch arrays larger than this are not kept
+    static const size_t max_scratch_size = 4096;
+
+    ResponseFields* response;
+
+    // The arrays and objects being read, outermost first. They are kept
+    // once read, and reused by the next parse on the same thread
+    static thread_local std::deque<Container> scratch;
+    std::deque<Container>& stack;
+    size_t depth;
+};
+
+thread_local std::deque<DatumBuilder::Container> DatumBuilder::scratch;
+
 Datum read_datum(const std::string& json) {
-    rapidjson::Document document;
-    document.Parse(json);
-    return read_datum(document);
+    DatumBuilder builder;
+    rapidjson::Reader reader;
+    rapidjson::StringStream stream(json.c_str());
+    if (reader.Parse(stream, builder).IsError()) {
+        return Nil();
+    }
+    return std::move(builder.root);
 }
 
-Datum read_datum(const rapidjson::Value &json) {
-    switch(json.GetType()) {
-    case rapidjson::kNullType: return Nil();
-    case rapidjson::kFalseType: return false;
-    case rapidjson::kTrueType: return true;
-    case rapidjson::kNumberType: return json.GetDouble();
-    case rapidjson::kStringType:
-        return std::string(json.GetString(), json.GetStringLength());
-
-    case rapidjson::kObjectType: {
-        Object result;
-        for (rapidjson::Value::ConstMemberIterator it = json.MemberBegin();
-             it != json.MemberEnd(); ++it) {
-            result.insert(std::make_pair(std::string(it->name.GetString(),
-                                         it->name.GetStringLength()),
-                                         read_datum(it->value)));
-        }
-
-        if (result.count("$reql_type$"))
-            return Datum(std::move(result)).from_raw();
-        return std::move(result);
-    } break;
-    case rapidjson::kArrayType: {
-        Array result;
-        result.reserve(json.Size());
-        for (rapidjson::Value::ConstValueIterator it = json.Begin();
-             it != json.End(); ++it) {
-            result.push_back(read_datum(*it));
-        }
-        return std::move(result);
-    } break;
-    default:
-        throw Error("invalid rapidjson value");
-    }
+bool read_response(char* json, ResponseFields* response) {
+    DatumBuilder builder(response);
+    rapidjson::Reader reader;
+    rapidjson::InsituStringStream stream(json);
+    return !reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseDefaultFlags>(stream, builder).IsError();
 }
 
 std::string write_datum(const Datum& datum) {
@@ -2,18 +2,28 @@
 
 #include "datum.h"
 
-namespace rapidjson {
-  class CrtAllocator;
-  template<typename> struct UTF8;
-  template <typename, typename> class GenericValue;
-  template <typename> class MemoryPoolAllocator;
-  typedef GenericValue<UTF8<char>, MemoryPoolAllocator<CrtAllocator> > Value;
-}
-
 namespace RethinkDB {
 
+// The fields of a response from the server that the driver uses
+struct ResponseFields {
+    double type = 0;
+    double error_type = 0;
+    Array result;
+};
+
 Datum read_datum(const std::string&);
-Datum read_datum(const rapidjson::Value &json);
+
+// Parse a response from the server in place. The buffer must be null
+// terminated, and is modified. The datums of the result are built while
+// the JSON is read, without an intermediate DOM. Returns false if the JSON
+// is invalid or is not a response
+bool read_response(char* json, ResponseFields*);
+
 std::string write_datum(const Datum&);
 
+// Build the datum represented by an object with a $reql_type$ field.
+// Returns false, without touching the object, if it is not a pseudo-type
+// that Datum represents, such as GEOMETRY or GROUPED_DATA
+bool read_pseudo_type(const Object&, Datum*);
+
 }
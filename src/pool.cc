@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "pool.h"
+#include "connection_p.h"
+#include "exceptions.h"
+
+namespace RethinkDB {
+
+using QueryType = Protocol::Query::QueryType;
+
+class ConnectionPoolPrivate {
+public:
+    ConnectionPoolPrivate(std::vector<Host>&& hosts_, PoolOptions&& options_)
+        : hosts(std::move(hosts_)), options(std::move(options_)), dns(hosts.size()),
+          guarded_closing(false), guarded_busy(false)
+    { }
+
+    struct Slot {
+        size_t host;
+        std::shared_ptr<Connection> conn;
+        Clock::time_point last_ping;
+    };
+
+    struct Resolved {
+        std::vector<Address> addresses;
+        Clock::time_point expires;
+    };
+
+    std::shared_ptr<Connection> open(size_t host);
+    std::vector<Address> addresses(size_t host);
+    void maintain();
+
+    static bool healthy(Connection&);
+    static size_t outstanding(Connection&);
+    static bool ping(Connection&, double wait);
+
+    const std::vector<Host> hosts;
+    const PoolOptions options;
+
+    std::mutex dns_lock;
+    std::vector<Resolved> dns;
+
+    mutable std::mutex lock;
+    std::condition_variable cond;
+    std::vector<Slot> guarded_slots;
+    bool guarded_closing;
+
+    // Set while the maintainer opens or pings a connection without the lock
+    bool guarded_busy;
+
+    std::thread maintainer;
+};
+
+ConnectionPool::ConnectionPool(std::vector<Host> hosts, PoolOptions options)
+    : d(new ConnectionPoolPrivate(std::move(hosts), std::move(options))) {
+    Error error("ConnectionPool: no hosts given");
+    bool connected = false;
+    for (size_t host = 0; host < d->hosts.size(); ++host) {
+        for (size_t i = 0; i < d->options.connections_per_host; ++i) {
+            ConnectionPoolPrivate::Slot slot{host, nullptr, Clock::now()};
+            try {
+                slot.conn = d->open(host);
+                connected = true;
+            } catch (Error& e) {
+                error = std::move(e);
+            }
+            d->guarded_slots.push_back(std::move(slot));
+        }
+    }
+
+    if (!connected) {
+        throw error;
+    }
+
+    std::shared_ptr<ConnectionPoolPrivate> pool = d;
+    d->maintainer = std::thread([pool]() { pool->maintain(); });
+}
+
+ConnectionPool::~ConnectionPool() {
+    close();
+}
+
+std::shared_ptr<Connection> ConnectionPool::get() {
+    std::lock_guard<std::mutex> guard(d->lock);
+    std::vector<bool> usable(d->guarded_slots.size());
+    std::vector<size_t> counts(d->guarded_slots.size());
+    std::vector<size_t> host_counts(d->hosts.size());
+    for (size_t i = 0; i < d->guarded_slots.size(); ++i) {
+        auto& slot = d->guarded_slots[i];
+        usable[i] = slot.conn && ConnectionPoolPrivate::healthy(*slot.conn);
+        if (usable[i]) {
+            counts[i] = ConnectionPoolPrivate::outstanding(*slot.conn);
+            host_counts[slot.host] += counts[i];
+        }
+    }
+
+    std::shared_ptr<Connection> best;
+    size_t best_outstanding = 0;
+    bool limited = false;
+    for (size_t i = 0; i < d->guarded_slots.size(); ++i) {
+        auto& slot = d->guarded_slots[i];
+        if (!usable[i]) {
+            continue;
+        }
+        size_t limit = d->options.max_outstanding_per_host;
+        if (limit && host_counts[slot.host] >= limit) {
+            limited = true;
+            continue;
+        }
+        if (!best || counts[i] < best_outstanding) {
+            best = slot.conn;
+            best_outstanding = counts[i];
+        }
+    }
+
+    if (!best && limited) {
+        throw Error("ConnectionPool: too many outstanding queries");
+    }
+    if (!best) {
+        throw Error("ConnectionPool: no connection available");
+    }
+    return best;
+}
+
+size_t ConnectionPool::size() const {
+    std::lock_guard<std::mutex> guard(d->lock);
+    size_t n = 0;
+    for (auto& slot : d->guarded_slots) {
+        if (slot.conn && ConnectionPoolPrivate::healthy(*slot.conn)) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+void ConnectionPool::close() {
+    bool busy;
+    {
+        std::lock_guard<std::mutex> guard(d->lock);
+        d->guarded_closing = true;
+        d->cond.notify_all();
+        busy = d->guarded_busy;
+    }
+    // A busy maintainer can take up to connect_timeout or ping_timeout.
+    // It stops by itself once done, and keeps the pool alive until then
+    if (d->maintainer.joinable()) {
+        if (busy) {
+            d->maintainer.detach();
+        } else {
+            d->maintainer.join();
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(d->lock);
+    d->guarded_slots.clear();
+}
+
+std::vector<Address> ConnectionPoolPrivate::addresses(size_t host) {
+    std::lock_guard<std::mutex> guard(dns_lock);
+    Resolved& resolved = dns[host];
+    if (resolved.addresses.empty() || Clock::now() >= resolved.expires) {
+        try {
+            resolved.addresses = resolve(hosts[host].name, hosts[host].port);
+            resolved.expires = Clock::now() + seconds(options.dns_ttl);
+        } catch (const Error&) {
+            // Keep using stale addresses if there are any
+            if (resolved.addresses.empty()) {
+                throw;
+            }
+        }
+    }
+    return resolved.addresses;
+}
+
+std::shared_ptr<Connection> ConnectionPoolPrivate::open(size_t host) {
+    std::unique_ptr<ConnectionPrivate> conn =
+        open_connection(addresses(host), options.auth_key, options.connect_options);
+    return std::shared_ptr<Connection>(new Connection(conn.release()));
+}
+
+void ConnectionPoolPrivate::maintain() {
+    Clock::duration interval = seconds(std::min(options.reconnect_interval, options.ping_interval));
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        cond.wait_for(guard, interval);
+        if (guarded_closing) {
+            return;
+        }
+
+        for (size_t i = 0; i < guarded_slots.size() && !guarded_closing; ++i) {
+            std::shared_ptr<Connection> conn = guarded_slots[i].conn;
+            size_t host = guarded_slots[i].host;
+            if (conn && !healthy(*conn)) {
+                guarded_slots[i].conn.reset();
+                conn.reset();
+            }
+
+            if (!conn) {
+                guarded_busy = true;
+                guard.unlock();
+                try {
+                    conn = open(host);
+                } catch (const Error&) {
+                    // Try again on the next round
+                }
+                guard.lock();
+                guarded_busy = false;
+                if (guarded_closing) {
+                    return;
+                }
+                guarded_slots[i].conn = conn;
+                guarded_slots[i].last_ping = Clock::now();
+            } else if (outstanding(*conn) == 0 &&
+                       Clock::now() - guarded_slots[i].last_ping >= seconds(options.ping_interval)) {
+                guarded_busy = true;
+                guard.unlock();
+                bool ok = ping(*conn, options.ping_timeout);
+                guard.lock();
+                guarded_busy = false;
+                if (guarded_closing) {
+                    return;
+                }
+                if (!ok && guarded_slots[i].conn == conn) {
+                    guarded_slots[i].conn.reset();
+                }
+                guarded_slots[i].last_ping = Clock::now();
+            }
+        }
+    }
+}
+
+bool ConnectionPoolPrivate::healthy(Connection& conn) {
+    return !conn.d->reader_failed;
+}
+
+size_t ConnectionPoolPrivate::outstanding(Connection& conn) {
+    size_t count = 0;
+    conn.d->for_each_token([&count](uint64_t, ConnectionPrivate::TokenCache&) {
+        ++count;
+    });
+    return count;
+}
+
+bool ConnectionPoolPrivate::ping(Connection& conn, double wait) {
+    ConnectionPrivate* d = conn.d.get();
+    uint64_t token = d->new_token();
+    d->add_token(token);
+
+    try {
+        d->run_query(Query{QueryType::START, token, Datum(1.0)});
+        Response response = d->wait_for_response(token, wait);
+        return response.type == Protocol::Response::ResponseType::SUCCESS_ATOM;
+    } catch (const Error&) {
+    } catch (const TimeoutException&) {
+    }
+
+    d->remove_token(token);
+    return false;
+}
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+
+#include "connection.h"
+
+namespace RethinkDB {
+
+// A server that is part of a cluster. As with connect(), the name may be
+// "unix:/path/to/socket" to reach the server over a Unix domain socket.
+struct Host {
+    Host(std::string name_, int port_ = 28015) : name(std::move(name_)), port(port_) { }
+
+    std::string name;
+    int port;
+};
+
+// Options for ConnectionPool
+struct PoolOptions {
+    // The number of connections kept open to each host
+    size_t connections_per_host = 2;
+
+    // get() skips the connections of a host once its connections have this
+    // many queries outstanding in total. 0 for no limit
+    size_t max_outstanding_per_host = 0;
+
+    // Idle connections are pinged this often, and dropped if they do not answer in time
+    double ping_interval = 10 * SECOND;
+    double ping_timeout = 5 * SECOND;
+
+    // How often dropped connections are re-opened
+    double reconnect_interval = 1 * SECOND;
+
+    // How long resolved host addresses are reused before looking them up again
+    double dns_ttl = 60 * SECOND;
+
+    std::string auth_key;
+    ConnectOptions connect_options;
+};
+
+// A set of connections spread over the hosts of a cluster.
+// Connections are opened up front, checked in the background and re-opened
+// when they fail, so that get() never has to wait for a connection to be made.
+class ConnectionPoolPrivate;
+class ConnectionPool {
+public:
+    // Throws if none of the hosts can be reached
+    explicit ConnectionPool(std::vector<Host> hosts, PoolOptions options = PoolOptions());
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+    ~ConnectionPool();
+
+    // Returns the healthy connection with the fewest outstanding queries.
+    // Connections are shared, and stay usable for as long as they are held
+    // even if the pool drops them. Throws if no connection is available,
+    // or if every host is at max_outstanding_per_host.
+    std::shared_ptr<Connection> get();
+
+    // The number of healthy connections
+    size_t size() const;
+
+    // Stop the background checks and drop all connections. Does not wait
+    // for a connection that is being opened or pinged
+    void close();
+
+private:
+    // Shared with the background thread, which may finish opening a
+    // connection after the pool is gone
+    std::shared_ptr<ConnectionPoolPrivate> d;
+};
+
+}
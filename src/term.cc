@@ -50,12 +50,31 @@ Term nil() {
     return Term(Nil());
 }
 
-Cursor Term::run(Connection& conn, OptArgs&& opts) {
+Cursor Term::run(Connection& conn, OptArgs&& opts, double wait) {
     if (!free_vars.empty()) {
         throw Error("run: term has free variables");
     }
 
-    return conn.start_query(this, std::move(opts));
+    return conn.start_query(this, std::move(opts), wait);
+}
+
+std::future<Cursor> Term::run_async(Connection& conn, OptArgs&& opts) {
+    std::shared_ptr<std::promise<Cursor>> promise(new std::promise<Cursor>);
+    run_async(conn, [promise](Cursor&& cursor) {
+        promise->set_value(std::move(cursor));
+    }, [promise](Error&& error) {
+        promise->set_exception(std::make_exception_ptr(std::move(error)));
+    }, std::move(opts));
+    return promise->get_future();
+}
+
+void Term::run_async(Connection& conn, std::function<void(Cursor&&)> callback,
+                     std::function<void(Error&&)> errback, OptArgs&& opts) {
+    if (!free_vars.empty()) {
+        throw Error("run_async: term has free variables");
+    }
+
+    conn.start_query_async(this, std::move(opts), std::move(callback), std::move(errback));
 }
 
 struct {
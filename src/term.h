@@ -1,5 +1,7 @@
 #pragma once
 
+#include <future>
+
 #include "datum.h"
 #include "connection.h"
 #include "protocol_defs.h"
@@ -322,7 +324,24 @@ public:
 
     // Send the term to the server and return the results.
     // Errors returned by the server are thrown.
-    Cursor run(Connection&, OptArgs&& args = {});
+    // If the first batch does not arrive within wait seconds, the query
+    // is stopped and TimeoutException is thrown.
+    Cursor run(Connection&, OptArgs&& args = {}, double wait = FOREVER);
+
+    // Send the term to the server without waiting for the results.
+    // The future becomes ready, or the callback is called from the thread
+    // that reads the connection's responses, normally its reader thread,
+    // once the first batch has arrived.
+    // Other queries can be run on the same connection in the meantime.
+    // No other responses are read while a callback runs, so a callback
+    // that waits for a query on the same connection, for instance with
+    // run() or future::get(), deadlocks. Exceptions thrown by the callback
+    // are passed to errback.
+    // A connection that has run an asynchronous query keeps its reader
+    // thread from then on, see ConnectOptions::reader_thread.
+    std::future<Cursor> run_async(Connection&, OptArgs&& args = {});
+    void run_async(Connection&, std::function<void(Cursor&&)> callback,
+                   std::function<void(Error&&)> errback, OptArgs&& args = {});
 
     // $doc(do)
     template <class ...T>
@@ -353,6 +372,7 @@ public:
 private:
     friend class Var;
     friend class Connection;
+    friend class IngestStream;
     friend struct Query;
 
     template <int _>
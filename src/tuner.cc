@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "tuner_p.h"
+
+namespace RethinkDB {
+
+using TT = Protocol::Term::TermType;
+
+// The server's default for max_batch_bytes, and how far it is raised
+const double default_batch_bytes = 1024 * 1024;
+const double max_batch_bytes = 16 * 1024 * 1024;
+
+// Weight of the latest cursor in the averages
+const double tuning_weight = 0.25;
+
+// The number of shapes remembered, beyond which they are all forgotten
+const size_t max_shapes = 1024;
+
+static void mix(uint64_t* hash, uint64_t value) {
+    // FNV-1a
+    for (int i = 0; i < 8; ++i) {
+        *hash ^= (value >> (i * 8)) & 0xff;
+        *hash *= 1099511628211ULL;
+    }
+}
+
+static void mix(uint64_t* hash, const std::string& string) {
+    for (char c : string) {
+        mix(hash, static_cast<unsigned char>(c));
+    }
+    mix(hash, string.size());
+}
+
+static void mix_shape(uint64_t* hash, const Datum& term, bool keep_literals) {
+    const Array* array = term.get_array();
+    if (array && !array->empty() && (*array)[0].get_number()) {
+        TT type = static_cast<TT>(*(*array)[0].get_number());
+        mix(hash, static_cast<uint64_t>(type));
+        bool names = type == TT::DB || type == TT::TABLE;
+        if (array->size() > 1 && (*array)[1].get_array()) {
+            const Array& args = *(*array)[1].get_array();
+            mix(hash, args.size());
+            for (const auto& arg : args) {
+                mix_shape(hash, arg, names);
+            }
+        }
+        if (array->size() > 2 && (*array)[2].get_object()) {
+            for (const auto& it : *(*array)[2].get_object()) {
+                mix(hash, it.first);
+                mix_shape(hash, it.second, false);
+            }
+        }
+        return;
+    }
+
+    const Object* object = term.get_object();
+    if (object) {
+        for (const auto& it : *object) {
+            mix(hash, it.first);
+            mix_shape(hash, it.second, false);
+        }
+        return;
+    }
+
+    const std::string* string = term.get_string();
+    if (string && keep_literals) {
+        mix(hash, *string);
+    } else {
+        mix(hash, term.is_number() ? 1 : term.is_string() ? 2 : term.is_boolean() ? 3 : 0);
+    }
+}
+
+uint64_t BatchTuner::shape(const Datum& term) {
+    uint64_t hash = 14695981039346656037ULL;
+    mix_shape(&hash, term, false);
+    return hash ? hash : 1;
+}
+
+void BatchTuner::apply(uint64_t shape, OptArgs& opts) {
+    for (const char* name : {"max_batch_rows", "max_batch_bytes", "max_batch_seconds",
+                             "first_batch_scaledown_factor"}) {
+        if (opts.count(name)) {
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = guarded_stats.find(shape);
+    if (it == guarded_stats.end()) {
+        return;
+    }
+    const Stats& stats = it->second;
+
+    if (stats.exhausted < 0.5) {
+        // Usually closed early: only fetch about as many rows as are read
+        double rows = 16;
+        while (rows < stats.rows * 1.5) {
+            rows *= 2;
+        }
+        opts.emplace("max_batch_rows", expr(rows));
+    } else if (stats.batch_bytes > default_batch_bytes) {
+        // A scan that waits for the server: fewer, larger batches, starting with the first
+        opts.emplace("max_batch_bytes", expr(stats.batch_bytes));
+        opts.emplace("first_batch_scaledown_factor", expr(1));
+    }
+}
+
+void BatchTuner::record(uint64_t shape, size_t rows, size_t batches, bool exhausted,
+                        double wait_fraction) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (guarded_stats.size() >= max_shapes && !guarded_stats.count(shape)) {
+        guarded_stats.clear();
+    }
+
+    Stats& stats = guarded_stats[shape];
+    double weight = stats.samples ? tuning_weight : 1;
+    stats.rows += weight * (rows - stats.rows);
+    stats.exhausted += weight * ((exhausted ? 1 : 0) - stats.exhausted);
+    if (!stats.samples) {
+        stats.batch_bytes = default_batch_bytes;
+    }
+    ++stats.samples;
+
+    if (exhausted && batches > 1) {
+        if (wait_fraction > 0.5) {
+            stats.batch_bytes = std::min(stats.batch_bytes * 2, max_batch_bytes);
+        } else if (wait_fraction < 0.1) {
+            stats.batch_bytes = std::max(stats.batch_bytes / 2, default_batch_bytes);
+        }
+    }
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+
+#include "datum.h"
+#include "term.h"
+
+namespace RethinkDB {
+
+// Learns batch sizes for queries of the same shape, from how their cursors
+// were consumed. See ConnectOptions::tune_batches
+class BatchTuner {
+public:
+    // A hash of the structure of a term, which ignores the values of its
+    // literals other than database and table names. Never 0
+    static uint64_t shape(const Datum& term);
+
+    // Add the batch optargs learned for the shape, unless any are already set
+    void apply(uint64_t shape, OptArgs&);
+
+    // Account for a cursor of the given shape being closed after the consumer
+    // read the given number of rows, out of batches batches, and spent the
+    // given fraction of the cursor's lifetime waiting for the server
+    void record(uint64_t shape, size_t rows, size_t batches, bool exhausted, double wait_fraction);
+
+private:
+    struct Stats {
+        size_t samples = 0;
+        double rows = 0;
+        double exhausted = 0;
+        double batch_bytes = 0;
+    };
+
+    std::mutex lock;
+    std::map<uint64_t, Stats> guarded_stats;
+};
+
+}
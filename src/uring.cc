@@ -0,0 +1,519 @@
+#include "uring_p.h"
+
+#ifdef RETHINKDB_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <set>
+#include <unordered_map>
+
+#include "connection_p.h"
+#include "exceptions.h"
+
+#endif
+
+namespace RethinkDB {
+
+#ifndef RETHINKDB_IO_URING
+
+bool uring_attach(ConnectionPrivate*) {
+    return false;
+}
+
+void uring_detach(ConnectionPrivate*) { }
+
+#else
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Receives data for many connections on a single thread. Every attached
+// connection has one recv in flight into a buffer of the loop, which is
+// copied into the connection's receive buffer once it completes. Each
+// round re-arms all the recvs that completed in the previous one and waits
+// for more completions with a single io_uring_enter call.
+//
+// The first buffers are registered with the kernel, as many as the
+// process may lock in memory, and are read into with READ_FIXED, which
+// saves mapping them on every recv. Since the buffers belong to the loop,
+// a connection can be detached while its recv is still in flight, which
+// lets callbacks run by the loop close their connection.
+class UringLoop {
+public:
+    // Returns null if io_uring is not available
+    static UringLoop* get();
+
+    void attach(ConnectionPrivate*);
+    void detach(ConnectionPrivate*);
+
+private:
+    bool setup();
+    void register_buffers();
+    void run();
+
+    struct io_uring_sqe* next_sqe();
+    bool submit(unsigned min_complete);
+    void arm_recv(unsigned slot);
+    void arm_wakeup();
+    void wake();
+
+    // Handle a completed recv. Returns false if the connection failed or
+    // was detached by a callback
+    bool received(unsigned slot, int result);
+
+    // Give the connection a buffer, or take it back. Only on the loop thread
+    unsigned take_slot(ConnectionPrivate*);
+    void release_slot(ConnectionPrivate*);
+
+    // Tags the completions of the read on wakeup_fd. Recvs are tagged
+    // with their slot plus one
+    static const uint64_t wakeup_tag = 0;
+
+    // The size of each buffer, and the most that are registered
+    static const size_t slot_size = 32 * 1024;
+    static const unsigned max_registered_slots = 128;
+
+    // A buffer that recvs are made into, and the connection it is for.
+    // Only the loop thread uses them
+    struct Slot {
+        char* buffer;
+        bool registered;
+
+        // Null while the slot is free, or while a recv is still in flight
+        // for a connection that was detached
+        ConnectionPrivate* conn = nullptr;
+        bool in_flight = false;
+    };
+    std::vector<Slot> slots;
+    std::vector<unsigned> free_slots;
+    std::unordered_map<ConnectionPrivate*, unsigned> slot_of;
+    void* registered_buffers = nullptr;
+    std::vector<std::unique_ptr<char[]>> buffers;
+
+    // The slots whose recv is to be made in this round
+    std::vector<unsigned> arming;
+
+    int ring_fd = -1;
+    int wakeup_fd = -1;
+    uint64_t wakeup_value = 0;
+
+    // The queues shared with the kernel. Only the loop thread uses them
+    unsigned sq_entries = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    struct io_uring_sqe* sqes = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    struct io_uring_cqe* cqes = nullptr;
+    unsigned to_submit = 0;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<ConnectionPrivate*> guarded_attaching;
+    std::set<ConnectionPrivate*> guarded_attached;
+    std::set<ConnectionPrivate*> guarded_detaching;
+    bool guarded_failed = false;
+
+    std::thread thread;
+};
+
+UringLoop* UringLoop::get() {
+    // Never destroyed, since connections may outlive any static object
+    static UringLoop* loop = []() -> UringLoop* {
+        UringLoop* loop = new UringLoop;
+        if (!loop->setup()) {
+            delete loop;
+            return nullptr;
+        }
+        loop->thread = std::thread(&UringLoop::run, loop);
+        return loop;
+    }();
+
+    if (loop) {
+        std::lock_guard<std::mutex> guard(loop->lock);
+        if (loop->guarded_failed) {
+            return nullptr;
+        }
+    }
+    return loop;
+}
+
+bool UringLoop::setup() {
+    const unsigned entries = 256;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd == -1) {
+        return false;
+    }
+
+    // Without fast poll, recvs on sockets would block kernel worker threads
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_FAST_POLL)) {
+        ::close(ring_fd);
+        return false;
+    }
+
+    size_t ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    void* ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        ::close(ring_fd);
+        return false;
+    }
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd, IORING_OFF_SQES);
+    if (sqes_map == MAP_FAILED) {
+        munmap(ring, ring_size);
+        ::close(ring_fd);
+        return false;
+    }
+
+    wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        munmap(sqes_map, sqes_size);
+        munmap(ring, ring_size);
+        ::close(ring_fd);
+        return false;
+    }
+
+    char* base = static_cast<char*>(ring);
+    sq_entries = params.sq_entries;
+    sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    sqes = static_cast<struct io_uring_sqe*>(sqes_map);
+    cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+
+    register_buffers();
+    return true;
+}
+
+void UringLoop::register_buffers() {
+    // Registered buffers count against RLIMIT_MEMLOCK, so take fewer
+    // until the kernel accepts them
+    for (unsigned count = max_registered_slots; count > 0; count /= 2) {
+        void* region = mmap(nullptr, count * slot_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            continue;
+        }
+        std::vector<struct iovec> iov(count);
+        for (unsigned i = 0; i < count; ++i) {
+            iov[i].iov_base = static_cast<char*>(region) + i * slot_size;
+            iov[i].iov_len = slot_size;
+        }
+        if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iov.data(), count) == 0) {
+            registered_buffers = region;
+            for (unsigned i = 0; i < count; ++i) {
+                Slot slot;
+                slot.buffer = static_cast<char*>(iov[i].iov_base);
+                slot.registered = true;
+                slots.push_back(slot);
+            }
+            // Hand out the lowest slots first
+            for (unsigned i = count; i > 0; --i) {
+                free_slots.push_back(i - 1);
+            }
+            return;
+        }
+        munmap(region, count * slot_size);
+    }
+}
+
+void UringLoop::attach(ConnectionPrivate* conn) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        guarded_attaching.push_back(conn);
+    }
+    wake();
+}
+
+void UringLoop::detach(ConnectionPrivate* conn) {
+    if (std::this_thread::get_id() == thread.get_id()) {
+        // From a callback run by the loop, which can not wait for itself.
+        // The recv in flight, if any, completes into the loop's buffer
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            guarded_attaching.erase(std::remove(guarded_attaching.begin(), guarded_attaching.end(), conn),
+                                    guarded_attaching.end());
+            guarded_attached.erase(conn);
+            guarded_detaching.erase(conn);
+        }
+        ::shutdown(conn->guarded_sockfd, SHUT_RDWR);
+        release_slot(conn);
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    if (guarded_failed) {
+        return;
+    }
+    guarded_detaching.insert(conn);
+
+    // Completes the recv in flight, if there is one
+    ::shutdown(conn->guarded_sockfd, SHUT_RDWR);
+    wake();
+    while (guarded_detaching.count(conn) && !guarded_failed) {
+        cond.wait(guard);
+    }
+}
+
+void UringLoop::wake() {
+    uint64_t one = 1;
+    ssize_t rv = ::write(wakeup_fd, &one, sizeof one);
+    (void)rv;
+}
+
+struct io_uring_sqe* UringLoop::next_sqe() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        // The kernel consumes all the entries it is given as soon as they are submitted
+        submit(0);
+    }
+
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+    return sqe;
+}
+
+bool UringLoop::submit(unsigned min_complete) {
+    while (true) {
+        int rv = io_uring_enter(ring_fd, to_submit, min_complete,
+                                min_complete ? IORING_ENTER_GETEVENTS : 0);
+        if (rv >= 0) {
+            to_submit -= rv;
+            return true;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        // The completion queue is full. The caller reaps and tries again
+        return errno == EBUSY || errno == EAGAIN;
+    }
+}
+
+void UringLoop::arm_wakeup() {
+    struct io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeup_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wakeup_value);
+    sqe->len = sizeof wakeup_value;
+    sqe->user_data = wakeup_tag;
+}
+
+unsigned UringLoop::take_slot(ConnectionPrivate* conn) {
+    unsigned index;
+    if (!free_slots.empty()) {
+        index = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        buffers.emplace_back(new char[slot_size]);
+        Slot slot;
+        slot.buffer = buffers.back().get();
+        slot.registered = false;
+        index = slots.size();
+        slots.push_back(slot);
+    }
+    slots[index].conn = conn;
+    slot_of[conn] = index;
+    return index;
+}
+
+void UringLoop::release_slot(ConnectionPrivate* conn) {
+    auto it = slot_of.find(conn);
+    if (it == slot_of.end()) {
+        return;
+    }
+    unsigned index = it->second;
+    slot_of.erase(it);
+    arming.erase(std::remove(arming.begin(), arming.end(), index), arming.end());
+    slots[index].conn = nullptr;
+
+    // Otherwise the slot is freed once its recv completes
+    if (!slots[index].in_flight) {
+        free_slots.push_back(index);
+    }
+}
+
+void UringLoop::arm_recv(unsigned index) {
+    Slot& slot = slots[index];
+    struct io_uring_sqe* sqe = next_sqe();
+    if (slot.registered) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = index;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->fd = slot.conn->guarded_sockfd;
+    sqe->addr = reinterpret_cast<uint64_t>(slot.buffer);
+    sqe->len = slot_size;
+    sqe->user_data = index + 1;
+    slot.in_flight = true;
+}
+
+bool UringLoop::received(unsigned index, int result) {
+    ConnectionPrivate* conn = slots[index].conn;
+    if (result <= 0) {
+        conn->fail(result == 0 ? Error("recv: connection closed by the server")
+                               : Error("recv: %s", strerror(-result)));
+        return false;
+    }
+
+    // The responses are delivered once the read lock is released, since a
+    // callback may destroy the connection
+    std::vector<std::pair<uint64_t, Response>> responses;
+    try {
+        ReadLock reader(conn);
+        reader.make_room(reader.buffered_size() + result);
+        memcpy(conn->recv_buffer.data() + conn->recv_end, slots[index].buffer, result);
+        conn->recv_end += result;
+        while (reader.has_response()) {
+            uint64_t token;
+            Response response = reader.recv_response(&token, Clock::time_point::max());
+            responses.emplace_back(token, std::move(response));
+        }
+    } catch (const Error& error) {
+        conn->fail(error);
+        return false;
+    }
+
+    for (auto& it : responses) {
+        conn->deliver_response(it.first, std::move(it.second));
+        if (slots[index].conn != conn) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void UringLoop::run() {
+    arm_wakeup();
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (ConnectionPrivate* conn : guarded_attaching) {
+                if (!guarded_detaching.erase(conn)) {
+                    guarded_attached.insert(conn);
+                    arming.push_back(take_slot(conn));
+                }
+            }
+            guarded_attaching.clear();
+
+            // The loop owns the buffers, so connections can go without
+            // waiting for their recv to complete
+            for (ConnectionPrivate* conn : guarded_detaching) {
+                guarded_attached.erase(conn);
+                release_slot(conn);
+            }
+            guarded_detaching.clear();
+            cond.notify_all();
+        }
+
+        for (unsigned index : arming) {
+            arm_recv(index);
+        }
+        arming.clear();
+
+        if (!submit(1)) {
+            Error error = Error::from_errno("io_uring_enter");
+            std::set<ConnectionPrivate*> attached;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                guarded_failed = true;
+                attached.swap(guarded_attached);
+                cond.notify_all();
+            }
+            for (ConnectionPrivate* conn : attached) {
+                conn->fail(error);
+            }
+            return;
+        }
+
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            uint64_t tag = cqe->user_data;
+            int result = cqe->res;
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+
+            if (tag == wakeup_tag) {
+                arm_wakeup();
+                continue;
+            }
+
+            unsigned index = tag - 1;
+            slots[index].in_flight = false;
+            ConnectionPrivate* conn = slots[index].conn;
+            if (!conn) {
+                // The connection was detached while the recv was in flight
+                free_slots.push_back(index);
+                continue;
+            }
+
+            bool ok = received(index, result);
+            if (slots[index].conn != conn) {
+                // Detached by a callback
+                continue;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (guarded_detaching.erase(conn) || !ok) {
+                guarded_attached.erase(conn);
+                release_slot(conn);
+                cond.notify_all();
+            } else {
+                arming.push_back(index);
+            }
+        }
+    }
+}
+
+bool uring_attach(ConnectionPrivate* conn) {
+    UringLoop* loop = UringLoop::get();
+    if (!loop) {
+        return false;
+    }
+    conn->reader_running = true;
+    loop->attach(conn);
+    return true;
+}
+
+void uring_detach(ConnectionPrivate* conn) {
+    UringLoop* loop = UringLoop::get();
+    if (loop) {
+        loop->detach(conn);
+    }
+}
+
+#endif
+
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+namespace RethinkDB {
+
+class ConnectionPrivate;
+
+// Read the connection's responses on the thread shared by all connections
+// that use io_uring, in place of a reader thread of its own. Returns false
+// if io_uring is not available. Requires the state lock
+bool uring_attach(ConnectionPrivate*);
+
+// Stop reading for the connection, and wait until the shared thread no
+// longer uses it. Shuts the socket down
+void uring_detach(ConnectionPrivate*);
+
+}
@@ -1,6 +1,14 @@
+#include <cstdint>
+#include <cstring>
+
 #include "utils.h"
 #include "error.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RETHINKDB_BASE64_X86
+#include <immintrin.h>
+#endif
+
 namespace RethinkDB {
 
 size_t utf8_encode(unsigned int code, char* buf) {
@@ -42,112 +50,314 @@ size_t utf8_encode(unsigned int code, char* buf) {
     }
 }
 
-bool base64_decode(char c, int* out) {
-    if (c >= 'A' && c <= 'Z') {
-        *out = c - 'A';
-    } else if (c >= 'a' && c <= 'z') {
-        *out = c - ('a' - 26);
-    } else if (c >= '0' && c <= '9') {
-        *out = c - ('0' - 52);
-    } else if (c == '+') {
-        *out = 62;
-    } else if (c == '/') {
-        *out = 63;
-    } else {
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The value of each base64 character, or -1 for characters that are skipped
+static const struct Base64Values {
+    Base64Values() {
+        memset(values, -1, sizeof values);
+        for (int i = 0; i < 64; ++i) {
+            values[static_cast<unsigned char>(base64_alphabet[i])] = i;
+        }
+    }
+    signed char values[256];
+} base64_values;
+
+static void base64_encode_scalar(const unsigned char* in, size_t size, char* out) {
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        uint32_t group = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        out[0] = base64_alphabet[group >> 18];
+        out[1] = base64_alphabet[group >> 12 & 0x3F];
+        out[2] = base64_alphabet[group >> 6 & 0x3F];
+        out[3] = base64_alphabet[group & 0x3F];
+        out += 4;
+    }
+    if (i == size) {
+        return;
+    }
+    uint32_t group = in[i] << 16 | (i + 1 < size ? in[i + 1] << 8 : 0);
+    out[0] = base64_alphabet[group >> 18];
+    out[1] = base64_alphabet[group >> 12 & 0x3F];
+    out[2] = i + 1 < size ? base64_alphabet[group >> 6 & 0x3F] : '=';
+    out[3] = '=';
+}
+
+// Characters that are not part of the alphabet are skipped. Returns false
+// if the last group is a single character
+static bool base64_decode_scalar(const unsigned char* in, size_t size, char* out, size_t* written) {
+    char* start = out;
+    uint32_t group = 0;
+    int n = 0;
+    for (size_t i = 0; i < size; ++i) {
+        int value = base64_values.values[in[i]];
+        if (value < 0) {
+            continue;
+        }
+        group = group << 6 | value;
+        if (++n == 4) {
+            out[0] = group >> 16;
+            out[1] = group >> 8;
+            out[2] = group;
+            out += 3;
+            group = 0;
+            n = 0;
+        }
+    }
+    if (n == 1) {
         return false;
+    } else if (n == 2) {
+        *out++ = group >> 4;
+    } else if (n == 3) {
+        *out++ = group >> 10;
+        *out++ = group >> 2;
     }
+    *written = out - start;
     return true;
 }
 
-bool base64_decode(const std::string& in, std::string& out) {
-    out.clear();
-    out.reserve(in.size() * 3 / 4);
-    auto read = in.begin();
-    while (true) {
-        int c[4];
-        int end = 4;
-        for (int i = 0; i < 4; i++) {
-            while (true) {
-                if (read == in.end()) {
-                    c[i] = 0;
-                    end = i;
-                    i = 3;
-                    break;
-                } else if (base64_decode(*read, &c[i])) {
-                    ++read;
-                    break;
-                } else {
-                    ++read;
-                }
-            }
-        }
-        if (end == 1) return false;
-        int val = c[0] << 18 | c[1] << 12 | c[2] << 6 | c[3];
-        if (end > 1) out.append(1, val >> 16);
-        if (end > 2) out.append(1, val >> 8 & 0xFF);
-        if (end > 3) out.append(1, val & 0xFF);
-        if (end != 4) break;
+#ifdef RETHINKDB_BASE64_X86
+
+// The vector kernels only handle whole blocks of valid input, and leave
+// the rest to the scalar code. They follow Wojciech Muła's algorithms:
+// bytes are spread into 6-bit indices with a shuffle and two multiplies,
+// and characters are mapped to and from indices with shuffles of small
+// lookup tables indexed by nibbles
+
+__attribute__((target("ssse3")))
+static inline __m128i base64_encode_block(__m128i in) {
+    // Spread each group of 3 bytes over 4 indices
+    __m128i bytes = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m128i high = _mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)),
+                                   _mm_set1_epi32(0x04000040));
+    __m128i low = _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)),
+                                  _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(high, low);
+
+    // Map the indices to characters by adding an offset that depends on their range
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i letters = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(letters, _mm_set1_epi8(13)));
+    __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                    '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i base64_encode_block(__m256i in) {
+    __m256i bytes = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m256i high = _mm256_mulhi_epu16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x0fc0fc00)),
+                                      _mm256_set1_epi32(0x04000040));
+    __m256i low = _mm256_mullo_epi16(_mm256_and_si256(bytes, _mm256_set1_epi32(0x003f03f0)),
+                                     _mm256_set1_epi32(0x01000010));
+    __m256i indices = _mm256_or_si256(high, low);
+
+    __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    __m256i letters = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    range = _mm256_or_si256(range, _mm256_and_si256(letters, _mm256_set1_epi8(13)));
+    __m256i offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices);
+}
+
+// Returns the number of bytes encoded, a multiple of 3
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(const unsigned char* in, size_t size, char* out) {
+    size_t i = 0;
+    // Each block reads 16 bytes and encodes the first 12
+    for (; i + 16 <= size; i += 12, out += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), base64_encode_block(block));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_encode_avx2(const unsigned char* in, size_t size, char* out) {
+    size_t i = 0;
+    // Each block reads 28 bytes and encodes the first 24, 12 in each lane
+    for (; i + 28 <= size; i += 24, out += 32) {
+        __m256i block = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12)), 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), base64_encode_block(block));
+    }
+    return i;
+}
+
+// Maps characters to their values. Returns false if any character is not
+// part of the alphabet
+__attribute__((target("ssse3")))
+static inline bool base64_decode_block(__m128i in, __m128i* values) {
+    __m128i high_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0F));
+    __m128i low_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x0F));
+
+    // The valid high nibbles for each low nibble, as bits
+    __m128i valid = _mm_setr_epi8(
+        0xA8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8,
+        0xF8, 0xF8, 0xF0, 0x54, 0x50, 0x50, 0x50, 0x54);
+    __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i invalid = _mm_cmpeq_epi8(
+        _mm_and_si128(_mm_shuffle_epi8(valid, low_nibbles), _mm_shuffle_epi8(bits, high_nibbles)),
+        _mm_setzero_si128());
+    if (_mm_movemask_epi8(invalid)) {
+        return false;
     }
+
+    // The offset depends on the high nibble, except that '/' and '+' share one
+    __m128i offsets = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i offset = _mm_shuffle_epi8(offsets, high_nibbles);
+    __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    offset = _mm_add_epi8(offset, _mm_and_si128(slash, _mm_set1_epi8(-3)));
+    *values = _mm_add_epi8(in, offset);
     return true;
 }
 
-char base64_encode(unsigned int c) {
-    if (c < 26) {
-        return 'A' + c;
-    } else if (c < 52) {
-        return 'a' + c - 26;
-    } else if (c < 62) {
-        return '0' + c - 52;
-    } else if (c == 62) {
-        return '+';
-    } else if (c == 63) {
-        return '/';
-    } else {
-        throw Error("unreachable: base64 encoding %d", c);
+__attribute__((target("avx2")))
+static inline bool base64_decode_block(__m256i in, __m256i* values) {
+    __m256i high_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0F));
+    __m256i low_nibbles = _mm256_and_si256(in, _mm256_set1_epi8(0x0F));
+
+    __m256i valid = _mm256_setr_epi8(
+        0xA8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8,
+        0xF8, 0xF8, 0xF0, 0x54, 0x50, 0x50, 0x50, 0x54,
+        0xA8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8, 0xF8,
+        0xF8, 0xF8, 0xF0, 0x54, 0x50, 0x50, 0x50, 0x54);
+    __m256i bits = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i invalid = _mm256_cmpeq_epi8(
+        _mm256_and_si256(_mm256_shuffle_epi8(valid, low_nibbles),
+                         _mm256_shuffle_epi8(bits, high_nibbles)),
+        _mm256_setzero_si256());
+    if (_mm256_movemask_epi8(invalid)) {
+        return false;
     }
+
+    __m256i offsets = _mm256_setr_epi8(
+        0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i offset = _mm256_shuffle_epi8(offsets, high_nibbles);
+    __m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+    offset = _mm256_add_epi8(offset, _mm256_and_si256(slash, _mm256_set1_epi8(-3)));
+    *values = _mm256_add_epi8(in, offset);
+    return true;
 }
 
-void base64_encode(unsigned int* c, int n, std::string& out) {
-    if (n == 0) {
-        return;
+// Returns the number of characters decoded, a multiple of 4. Stops at the
+// first block that has padding or any other character to skip. Writes up
+// to 4 bytes past the decoded data
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const unsigned char* in, size_t size, char* out) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16, out += 12) {
+        __m128i values;
+        if (!base64_decode_block(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), &values)) {
+            break;
+        }
+        // Pack each group of 4 6-bit values into 3 bytes
+        __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        __m128i bytes = _mm_shuffle_epi8(groups, _mm_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), bytes);
     }
-    out.append(1, base64_encode(c[0] >> 2));
-    out.append(1, base64_encode((c[0] & 0x3) << 4 | c[1] >> 4));
-    if (n == 1) {
-        out.append("==");
-        return;
+    return i;
+}
+
+// Writes up to 8 bytes past the decoded data
+__attribute__((target("avx2")))
+static size_t base64_decode_avx2(const unsigned char* in, size_t size, char* out) {
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32, out += 24) {
+        __m256i values;
+        if (!base64_decode_block(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)), &values)) {
+            break;
+        }
+        __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i groups = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        __m256i bytes = _mm256_shuffle_epi8(groups, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        // Move the 12 bytes of each lane next to each other
+        bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), bytes);
     }
-    out.append(1, base64_encode((c[1] & 0xF) << 2 | c[2] >> 6));
-    if (n == 2) {
-        out.append("=");
-        return;
+    return i;
+}
+
+enum class Base64Kernel { SCALAR, SSSE3, AVX2 };
+
+static Base64Kernel base64_kernel() {
+    static const Base64Kernel kernel = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return Base64Kernel::AVX2;
+        } else if (__builtin_cpu_supports("ssse3")) {
+            return Base64Kernel::SSSE3;
+        }
+        return Base64Kernel::SCALAR;
+    }();
+    return kernel;
+}
+
+#endif
+
+// Room for the bytes that the vector kernels write past the decoded data
+static const size_t base64_decode_slack = 8;
+
+bool base64_decode(const std::string& in, std::string& out) {
+    const unsigned char* read = reinterpret_cast<const unsigned char*>(in.data());
+    out.resize(in.size() / 4 * 3 + 2 + base64_decode_slack);
+    char* write = &out[0];
+
+    size_t decoded = 0;
+#ifdef RETHINKDB_BASE64_X86
+    switch (base64_kernel()) {
+    case Base64Kernel::AVX2: decoded = base64_decode_avx2(read, in.size(), write); break;
+    case Base64Kernel::SSSE3: decoded = base64_decode_ssse3(read, in.size(), write); break;
+    case Base64Kernel::SCALAR: break;
+    }
+#endif
+
+    size_t written;
+    if (!base64_decode_scalar(read + decoded, in.size() - decoded, write + decoded / 4 * 3, &written)) {
+        out.clear();
+        return false;
     }
-    out.append(1, base64_encode(c[2] & 0x3F));
+    out.resize(decoded / 4 * 3 + written);
+    return true;
 }
 
 std::string base64_encode(const std::string& in) {
     std::string out;
-    out.reserve(in.size() * 4 / 3 + in.size() / 48 + 3);
-    auto read = in.begin();
-    while (true) {
-        for (int group = 0; group < 16; ++group) {
-            unsigned int c[3];
-            int i = 0;
-            for (; i < 3; ++i) {
-                if (read == in.end()) {
-                    c[i] = 0;
-                    break;
-                } else {
-                    c[i] = static_cast<unsigned char>(*read++);
-                }
-            }
-            base64_encode(c, i, out);
-            if (i != 3) {
-                return out;
-            }
-        }
-        out.append("\n");
+    base64_encode(in, out);
+    return out;
+}
+
+void base64_encode(const std::string& in, std::string& out) {
+    const unsigned char* read = reinterpret_cast<const unsigned char*>(in.data());
+    size_t start = out.size();
+    out.resize(start + (in.size() + 2) / 3 * 4);
+    char* write = &out[0] + start;
+
+    size_t encoded = 0;
+#ifdef RETHINKDB_BASE64_X86
+    switch (base64_kernel()) {
+    case Base64Kernel::AVX2: encoded = base64_encode_avx2(read, in.size(), write); break;
+    case Base64Kernel::SSSE3: encoded = base64_encode_ssse3(read, in.size(), write); break;
+    case Base64Kernel::SCALAR: break;
     }
+#endif
+
+    base64_encode_scalar(read + encoded, in.size() - encoded, write + encoded / 3 * 4);
 }
 
 }
@@ -9,9 +9,15 @@ namespace RethinkDB {
 const size_t max_utf8_encoded_size = 6;
 
 // Decode a base64 string. Returns false on failure.
+// Characters outside of the alphabet, such as padding and newlines, are skipped.
 bool base64_decode(const std::string& in, std::string& out);
+
+// Encode without line breaks
 std::string base64_encode(const std::string&);
 
+// Append the base64 encoding of in to out
+void base64_encode(const std::string& in, std::string& out);
+
 // Encodes a single unicode codepoint into UTF-8. Returns the number of bytes written.
 // Does not add a trailing null byte
 size_t utf8_encode(unsigned int, char*);
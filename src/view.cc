@@ -0,0 +1,224 @@
+#include "view_p.h"
+#include "exceptions.h"
+#include "json_p.h"
+
+#include "rapidjson-config.h"
+#include "rapidjson/document.h"
+
+namespace RethinkDB {
+
+// The JSON that views point into, and the DOM parsed from it. Strings in
+// the DOM are parsed in place, so they point into the JSON
+class ViewDocument {
+public:
+    explicit ViewDocument(std::string&& json_) : json(std::move(json_)) { }
+
+    static DatumView view(const std::shared_ptr<const ViewDocument>& document,
+                          const rapidjson::Value* value) {
+        return DatumView(document, value);
+    }
+
+    std::string json;
+    rapidjson::Document dom;
+};
+
+DatumView read_view(std::string&& json) {
+    std::shared_ptr<ViewDocument> document(new ViewDocument(std::move(json)));
+    document->dom.ParseInsitu(&document->json[0]);
+    if (document->dom.HasParseError()) {
+        return DatumView();
+    }
+    return ViewDocument::view(document, &document->dom);
+}
+
+static const rapidjson::Value* get(const void* value) {
+    return static_cast<const rapidjson::Value*>(value);
+}
+
+DatumView DatumView::view(const void* child) const {
+    return DatumView(document, child);
+}
+
+bool DatumView::is_nil() const {
+    return value && get(value)->IsNull();
+}
+
+bool DatumView::is_boolean() const {
+    return value && get(value)->IsBool();
+}
+
+bool DatumView::is_number() const {
+    return value && get(value)->IsNumber();
+}
+
+bool DatumView::is_string() const {
+    return value && get(value)->IsString();
+}
+
+bool DatumView::is_object() const {
+    return value && get(value)->IsObject();
+}
+
+bool DatumView::is_array() const {
+    return value && get(value)->IsArray();
+}
+
+bool DatumView::get_boolean(bool* boolean) const {
+    if (!is_boolean()) {
+        return false;
+    }
+    *boolean = get(value)->GetBool();
+    return true;
+}
+
+bool DatumView::get_number(double* number) const {
+    if (!is_number()) {
+        return false;
+    }
+    *number = get(value)->GetDouble();
+    return true;
+}
+
+const char* DatumView::get_string(size_t* size) const {
+    if (!is_string()) {
+        return nullptr;
+    }
+    if (size) {
+        *size = get(value)->GetStringLength();
+    }
+    return get(value)->GetString();
+}
+
+DatumView DatumView::get_field(const char* key) const {
+    if (!is_object()) {
+        return DatumView();
+    }
+    auto it = get(value)->FindMember(key);
+    if (it == get(value)->MemberEnd()) {
+        return DatumView();
+    }
+    return view(&it->value);
+}
+
+DatumView DatumView::get_field(const std::string& key) const {
+    if (!is_object()) {
+        return DatumView();
+    }
+    auto it = get(value)->FindMember(key);
+    if (it == get(value)->MemberEnd()) {
+        return DatumView();
+    }
+    return view(&it->value);
+}
+
+DatumView DatumView::get_nth(size_t i) const {
+    if (!is_array() || i >= get(value)->Size()) {
+        return DatumView();
+    }
+    return view(&(*get(value))[i]);
+}
+
+size_t DatumView::size() const {
+    if (is_array()) {
+        return get(value)->Size();
+    }
+    if (is_object()) {
+        return get(value)->MemberCount();
+    }
+    return 0;
+}
+
+bool DatumView::extract_boolean() const {
+    bool boolean;
+    if (!get_boolean(&boolean)) {
+        throw Error("extract_bool: Not a boolean");
+    }
+    return boolean;
+}
+
+double DatumView::extract_number() const {
+    double number;
+    if (!get_number(&number)) {
+        throw Error("extract_number: Not a number");
+    }
+    return number;
+}
+
+std::string DatumView::extract_string() const {
+    size_t size;
+    const char* string = get_string(&size);
+    if (!string) {
+        throw Error("extract_string: Not a string");
+    }
+    return std::string(string, size);
+}
+
+DatumView DatumView::extract_field(const std::string& key) const {
+    if (!is_object()) {
+        throw Error("extract_field: Not an object");
+    }
+    DatumView field = get_field(key);
+    if (!field.is_valid()) {
+        throw Error("extract_field: No such key in object");
+    }
+    return field;
+}
+
+DatumView DatumView::extract_nth(size_t i) const {
+    if (!is_array()) {
+        throw Error("extract_nth: Not an array");
+    }
+    DatumView element = get_nth(i);
+    if (!element.is_valid()) {
+        throw Error("extract_nth: index too large");
+    }
+    return element;
+}
+
+static Datum to_datum(const rapidjson::Value& value) {
+    switch (value.GetType()) {
+    case rapidjson::kNullType:
+        return Nil();
+    case rapidjson::kFalseType:
+        return false;
+    case rapidjson::kTrueType:
+        return true;
+    case rapidjson::kNumberType:
+        if (value.IsInt64()) {
+            return value.GetInt64();
+        }
+        return value.GetDouble();
+    case rapidjson::kStringType:
+        return std::string(value.GetString(), value.GetStringLength());
+    case rapidjson::kArrayType: {
+        Array array;
+        array.reserve(value.Size());
+        for (auto& element : value.GetArray()) {
+            array.emplace_back(to_datum(element));
+        }
+        return std::move(array);
+    }
+    case rapidjson::kObjectType: {
+        Object object;
+        for (auto& member : value.GetObject()) {
+            object.emplace(std::string(member.name.GetString(), member.name.GetStringLength()),
+                           to_datum(member.value));
+        }
+        Datum datum;
+        if (read_pseudo_type(object, &datum)) {
+            return datum;
+        }
+        return std::move(object);
+    }
+    }
+    return Nil();
+}
+
+Datum DatumView::to_datum() const {
+    if (!value) {
+        throw Error("to_datum: invalid view");
+    }
+    return RethinkDB::to_datum(*get(value));
+}
+
+}
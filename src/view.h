@@ -0,0 +1,68 @@
+#pragma once
+
+#include <memory>
+
+#include "datum.h"
+
+namespace RethinkDB {
+
+// A read-only view of a datum in the JSON received from the server.
+// Strings and keys are not copied out of the response: they point into
+// its buffer, which stays alive for as long as any view of it does.
+// Objects with a $reql_type$ field, such as times and binary strings, are
+// seen as plain objects. to_datum() makes an owned Datum out of the view.
+class ViewDocument;
+class DatumView {
+public:
+    // An invalid view, as returned for missing fields and out of range indexes
+    DatumView() : value(nullptr) { }
+
+    bool is_valid() const { return value != nullptr; }
+
+    bool is_nil() const;
+    bool is_boolean() const;
+    bool is_number() const;
+    bool is_string() const;
+    bool is_object() const;
+    bool is_array() const;
+
+    // get_* returns false, nullptr or an invalid view if the view has a different type
+
+    bool get_boolean(bool*) const;
+    bool get_number(double*) const;
+
+    // Points into the response, and is null terminated. The size is
+    // stored if it is not null
+    const char* get_string(size_t* size = nullptr) const;
+
+    DatumView get_field(const char* key) const;
+    DatumView get_field(const std::string& key) const;
+    DatumView get_nth(size_t) const;
+
+    // The number of elements or fields of an array or object, or 0
+    size_t size() const;
+
+    // extract_* throws an exception if the types don't match
+
+    bool extract_boolean() const;
+    double extract_number() const;
+    std::string extract_string() const;
+    DatumView extract_field(const std::string& key) const;
+    DatumView extract_nth(size_t) const;
+
+    // Copy the viewed datum, with pseudo-types converted as by Datum::from_raw
+    Datum to_datum() const;
+
+private:
+    DatumView(std::shared_ptr<const ViewDocument> document_, const void* value_)
+        : document(std::move(document_)), value(value_) { }
+
+    DatumView view(const void*) const;
+
+    std::shared_ptr<const ViewDocument> document;
+    const void* value;
+
+    friend class ViewDocument;
+};
+
+}
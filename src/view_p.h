@@ -0,0 +1,11 @@
+#pragma once
+
+#include "view.h"
+
+namespace RethinkDB {
+
+// Parse the JSON in place and return a view of it, which keeps the JSON
+// alive. Returns an invalid view if the JSON is invalid
+DatumView read_view(std::string&& json);
+
+}
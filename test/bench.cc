@@ -34,11 +34,242 @@ int main() {
 }
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
 #include <rethinkdb.h>
 
 namespace R = RethinkDB;
 
+// Counts heap allocations, to check that code paths meant not to allocate do
+// not, and the bytes they request, to measure the size of datums
+std::atomic<size_t> allocations(0);
+std::atomic<size_t> allocated_bytes(0);
+
+void* operator new(size_t size) {
+    ++allocations;
+    allocated_bytes += size;
+    void* p = malloc(size);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+// Queries per second when the given number of threads share a connection
+double queries_per_second(R::Connection& conn, size_t threads, double duration) {
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> queries(0);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&]() {
+            size_t n = 0;
+            while (!stop) {
+                R::expr(1).run(conn);
+                ++n;
+            }
+            queries += n;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+    stop = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return queries / elapsed.count();
+}
+
+void bench_threads() {
+    std::cout << "threads  queries/s  queries/s (reader thread)\n";
+    auto conn = R::connect();
+    R::ConnectOptions options;
+    options.reader_thread = true;
+    auto threaded = R::connect("localhost", 28015, "", options);
+    for (size_t threads = 1; threads <= 64; threads *= 2) {
+        printf("%7zu  %9.0f  %9.0f\n", threads,
+               queries_per_second(*conn, threads, 1),
+               queries_per_second(*threaded, threads, 1));
+    }
+}
+
+// Rows per second when the given number of threads each iterate a cursor
+// over a stream of small batches, so that most frames sent are CONTINUEs
+double rows_per_second(R::Connection& conn, size_t threads) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&]() {
+            R::Cursor cursor = R::range(20000).run(conn, {{"max_batch_rows", R::Term(10)}});
+            while (cursor.has_next()) {
+                cursor.next();
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return threads * 20000 / elapsed.count();
+}
+
+void bench_cursors() {
+    std::cout << "cursors  rows/s\n";
+    auto conn = R::connect();
+    for (size_t threads = 1; threads <= 64; threads *= 4) {
+        printf("%7zu  %6.0f\n", threads, rows_per_second(*conn, threads));
+    }
+}
+
+// Print the median and 99th percentile round trip of a point query
+void print_latency(const char* mode, const R::ConnectOptions& options) {
+    auto conn = R::connect("localhost", 28015, "", options);
+    std::vector<double> latencies;
+    for (int i = 0; i < 10000; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        R::expr(1).run(*conn);
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        latencies.push_back(elapsed.count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-22s  %6.1f  %6.1f\n", mode,
+           latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+}
+
+void bench_busy_poll() {
+    std::cout << "mode                    p50 us  p99 us\n";
+    R::ConnectOptions options;
+    print_latency("blocking", options);
+    options.busy_poll = 100 * MICROSECOND;
+    print_latency("busy poll", options);
+    options.reader_thread = true;
+    options.reader_cpu = 0;
+    print_latency("busy poll, reader", options);
+    options.busy_poll = 0;
+    print_latency("blocking, reader", options);
+}
+
+// Serialise an already built document, which should not allocate once the
+// output string and the writer's buffers have grown
+void bench_write_json() {
+    R::Array rows;
+    for (int i = 0; i < 1000; ++i) {
+        rows.emplace_back(R::Object{
+            {"id", i},
+            {"name", "a name long enough not to fit in a small string"},
+            {"tags", R::Array{"a", "b", "c"}},
+            {"nested", R::Object{{"score", i * 0.5}, {"active", i % 2 == 0}}},
+            {"created", R::Time(1500000000 + i, 3600)},
+            {"blob", R::Binary(std::string(100, 'x'))}});
+    }
+    R::Datum datum(std::move(rows));
+
+    std::string out;
+    datum.append_json(&out);
+    const int rounds = 100;
+    size_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        out.clear();
+        datum.append_json(&out);
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("write_json: %zu bytes in %.2f ms, %zu allocations\n",
+           out.size(), elapsed.count() / rounds, (allocations - before) / rounds);
+}
+
+// Encode and decode a large binary string
+void bench_base64() {
+    std::string data(8 << 20, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 2654435761u >> 13);
+    }
+    std::string encoded, decoded;
+    const int rounds = 10;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        encoded.clear();
+        R::base64_encode(data, encoded);
+    }
+    std::chrono::duration<double> encoding = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        R::base64_decode(encoded, decoded);
+    }
+    std::chrono::duration<double> decoding = std::chrono::steady_clock::now() - start;
+    printf("base64: encode %.0f MB/s, decode %.0f MB/s\n",
+           rounds * data.size() / 1e6 / encoding.count(), rounds * data.size() / 1e6 / decoding.count());
+}
+
+// The memory used by parsed documents, not counting the allocator's own overhead
+void print_datum_memory(const char* shape, const std::string& document) {
+    const int count = 10000;
+    std::string json = "[";
+    for (int i = 0; i < count; ++i) {
+        json += (i ? "," : "") + document;
+    }
+    json += "]";
+    size_t before = allocated_bytes;
+    R::Datum documents = R::Datum::from_json(json);
+    printf("%-8s  %6.0f\n", shape, (allocated_bytes - before) / static_cast<double>(count));
+}
+
+void bench_datum_memory() {
+    printf("sizeof(Datum) = %zu\n", sizeof(R::Datum));
+    std::cout << "document  bytes\n";
+    print_datum_memory("numbers", "[1,2.5,3,4.5,5,6.5,7,8.5]");
+    print_datum_memory("row", "{\"id\":12345,\"name\":\"a name long enough not to fit in a small string\","
+                       "\"score\":0.5,\"active\":true,\"tags\":[\"a\",\"b\",\"c\"]}");
+    print_datum_memory("counters", "{\"id\":1,\"reads\":100,\"writes\":20,\"errors\":0}");
+}
+
+// Read one field of every document of a scan, through datums or through views
+void scan_fields(const char* mode, bool views) {
+    R::ConnectOptions options;
+    options.defer_parsing = views;
+    auto conn = R::connect("localhost", 28015, "", options);
+    R::Term query = R::range(100000).map([](R::Var x) {
+        return R::object("id", *x, "name", "a name long enough not to fit in a small string");
+    });
+    double sum = 0;
+    size_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    R::Cursor cursor = query.run(*conn);
+    if (views) {
+        while (true) {
+            R::DatumView batch = cursor.next_batch_view();
+            if (batch.size() == 0) {
+                break;
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                sum += batch.get_nth(i).extract_field("id").extract_number();
+            }
+        }
+    } else {
+        for (R::Datum& row : cursor) {
+            sum += row.extract_field("id").extract_number();
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%-6s  %7.1f  %9.2f\n", mode, elapsed.count(), (allocations - before) / 100000.0);
+}
+
+void bench_views() {
+    std::cout << "scan    ms       allocs/row\n";
+    scan_fields("datums", false);
+    scan_fields("views", true);
+}
+
 int main() {
     auto conn = R::connect();
     if (!conn) {
@@ -52,7 +283,12 @@ int main() {
         std::cout << *db.get_string() << '\n';
     }
 
+    bench_threads();
+    bench_cursors();
+    bench_busy_poll();
+    bench_write_json();
+    bench_base64();
+    bench_datum_memory();
+    bench_views();
     return 0;
 }
-
-
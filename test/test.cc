@@ -1,11 +1,224 @@
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <ctime>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
 
 #include "testlib.h"
 
 extern void run_upstream_tests();
 
+// A server that speaks just enough of the protocol for tests that need to
+// control what the driver receives. Every query is passed to the handler,
+// along with the number of the connection it came on, and the handler
+// returns the responses to send, as pairs of token and JSON. Calls to the
+// handler are serialized.
+class StandInServer {
+public:
+    using Responses = std::vector<std::pair<uint64_t, std::string>>;
+    using Handler = std::function<Responses(size_t connection, uint64_t token, const R::Datum& query)>;
+
+    // Listens on 127.0.0.1, or on a Unix domain socket if a path is given
+    explicit StandInServer(Handler handler_, std::string unix_path_ = "")
+        : handler(std::move(handler_)), unix_path(std::move(unix_path_)) {
+        if (unix_path.empty()) {
+            listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof addr);
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr);
+            socklen_t len = sizeof addr;
+            getsockname(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &len);
+            host = "127.0.0.1";
+            port = ntohs(addr.sin_port);
+        } else {
+            listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof addr);
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, unix_path.c_str(), sizeof addr.sun_path - 1);
+            unlink(unix_path.c_str());
+            bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr);
+            host = "unix:" + unix_path;
+            port = 0;
+        }
+        listen(listen_fd, 16);
+        acceptor = std::thread(&StandInServer::accept_loop, this);
+    }
+
+    ~StandInServer() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            shutdown(listen_fd, SHUT_RDWR);
+            for (int fd : open_fds) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        acceptor.join();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        close(listen_fd);
+        if (!unix_path.empty()) {
+            unlink(unix_path.c_str());
+        }
+    }
+
+    // Close every open connection, as if the server had gone away
+    void drop() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int fd : open_fds) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+    // The number of connections accepted and of queries received so far
+    size_t connections() {
+        std::lock_guard<std::mutex> guard(lock);
+        return accepted;
+    }
+    size_t queries() {
+        std::lock_guard<std::mutex> guard(lock);
+        return received;
+    }
+
+    // For each query received so far, the number of the read that
+    // completed it. Queries that arrived in a single read share it
+    std::vector<size_t> reads_of_queries() {
+        std::lock_guard<std::mutex> guard(lock);
+        return read_of_query;
+    }
+
+    // The JSON of a response with a single value
+    static std::string atom(const R::Datum& value) {
+        return R::Datum(R::Object{{"t", 1}, {"r", R::Array{value}}}).as_json();
+    }
+
+    std::string host;
+    int port;
+
+private:
+    static bool read_all(int fd, char* buf, size_t size) {
+        while (size) {
+            ssize_t n = recv(fd, buf, size, 0);
+            if (n <= 0) return false;
+            buf += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    void accept_loop() {
+        while (true) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            std::lock_guard<std::mutex> guard(lock);
+            if (fd == -1 || stopping) {
+                if (fd != -1) close(fd);
+                return;
+            }
+            open_fds.push_back(fd);
+            threads.emplace_back(&StandInServer::serve, this, accepted++, fd);
+        }
+    }
+
+    void serve(size_t connection, int fd) {
+        char header[12];
+        uint32_t key_size;
+        bool ok = read_all(fd, header, 8);
+        if (ok) {
+            memcpy(&key_size, header + 4, 4);
+            std::vector<char> rest(key_size + 4);
+            ok = read_all(fd, rest.data(), rest.size()) &&
+                send(fd, "SUCCESS", 8, MSG_NOSIGNAL) == 8;
+        }
+        // Queries are read as they come, several at a time if they arrive together
+        std::string pending;
+        std::vector<char> chunk(64 * 1024);
+        while (ok) {
+            ssize_t n = recv(fd, chunk.data(), chunk.size(), 0);
+            if (n <= 0) break;
+            pending.append(chunk.data(), n);
+            size_t read;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                read = reads++;
+            }
+
+            size_t offset = 0;
+            while (pending.size() - offset >= 12) {
+                uint64_t token;
+                uint32_t size;
+                memcpy(&token, &pending[offset], 8);
+                memcpy(&size, &pending[offset + 8], 4);
+                if (pending.size() - offset - 12 < size) break;
+                std::string json = pending.substr(offset + 12, size);
+                offset += 12 + size;
+
+                std::lock_guard<std::mutex> guard(lock);
+                ++received;
+                read_of_query.push_back(read);
+                for (auto& response : handler(connection, token, R::Datum::from_json(json))) {
+                    uint32_t length = response.second.size();
+                    std::string frame(12, '\0');
+                    memcpy(&frame[0], &response.first, 8);
+                    memcpy(&frame[8], &length, 4);
+                    frame += response.second;
+                    send(fd, frame.data(), frame.size(), MSG_NOSIGNAL);
+                }
+            }
+            pending.erase(0, offset);
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        open_fds.erase(std::find(open_fds.begin(), open_fds.end(), fd));
+        close(fd);
+    }
+
+    Handler handler;
+    std::string unix_path;
+    int listen_fd;
+
+    std::mutex lock;
+    std::vector<int> open_fds;
+    std::vector<std::thread> threads;
+    size_t accepted = 0;
+    size_t received = 0;
+    size_t reads = 0;
+    std::vector<size_t> read_of_query;
+    bool stopping = false;
+    std::thread acceptor;
+};
+
+// The type of a query received by StandInServer
+int query_type(const R::Datum& query) {
+    return static_cast<int>(*query.get_nth(0)->get_number());
+}
+
+// Wait up to a few seconds for the condition to hold
+bool eventually(std::function<bool()> condition) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
 void test_json(const char* string, const char* ret = "") {
     TEST_EQ(R::Datum::from_json(string).as_json().c_str(), ret[0] ? ret : string);
 }
@@ -72,6 +285,105 @@ void test_binary() {
     exit_section();
 }
 
+// A plain bit by bit encoder, to check the vectorised ones against
+std::string reference_base64(const std::string& in) {
+    const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < in.size(); i += 3) {
+        size_t n = std::min<size_t>(3, in.size() - i);
+        uint32_t group = 0;
+        for (size_t j = 0; j < 3; ++j) {
+            group = group << 8 | (j < n ? static_cast<unsigned char>(in[i + j]) : 0);
+        }
+        for (size_t j = 0; j < 4; ++j) {
+            out += j <= n ? alphabet[group >> (18 - 6 * j) & 0x3F] : '=';
+        }
+    }
+    return out;
+}
+
+void test_base64_round_trip() {
+    enter_section("base64 round trip");
+    std::mt19937 random(28015);
+    std::vector<size_t> sizes;
+    for (size_t size = 0; size < 200; ++size) {
+        sizes.push_back(size);
+    }
+    for (int i = 0; i < 50; ++i) {
+        sizes.push_back(200 + random() % 5000);
+    }
+
+    size_t mismatches = 0;
+    for (size_t size : sizes) {
+        std::string data(size, '\0');
+        for (auto& c : data) {
+            c = static_cast<char>(random());
+        }
+        std::string encoded = R::base64_encode(data);
+        std::string decoded;
+        bool ok = encoded == reference_base64(data) && R::base64_decode(encoded, decoded) && decoded == data;
+
+        // Padding and line breaks are optional
+        std::string unpadded = encoded.substr(0, encoded.find('='));
+        ok = ok && R::base64_decode(unpadded, decoded) && decoded == data;
+        std::string wrapped;
+        for (size_t i = 0; i < encoded.size(); i += 76) {
+            wrapped += encoded.substr(i, 76) + "\n";
+        }
+        ok = ok && R::base64_decode(wrapped, decoded) && decoded == data;
+        if (!ok) {
+            ++mismatches;
+        }
+    }
+    TEST_EQ(mismatches, 0);
+
+    std::string decoded;
+    TEST_EQ(R::base64_decode(std::string(64, 'A') + "A", decoded), false);
+    exit_section();
+}
+
+void test_pseudo_types() {
+    enter_section("pseudo types");
+    R::Datum parsed = R::Datum::from_json(
+        "[{\"$reql_type$\":\"TIME\",\"epoch_time\":1,\"timezone\":\"+00:00\"},"
+        "{\"$reql_type$\":\"GEOMETRY\",\"type\":\"Point\",\"coordinates\":[1,2]},"
+        "{\"$reql_type$\":\"UNKNOWN\",\"a\":{\"b\":1}},"
+        "{\"$reql_type$\":\"TIME\",\"epoch_time\":1},"
+        "{\"$reql_type$\":\"BINARY\",\"data\":\"A\"}]");
+    TEST_EQ(parsed.get_nth(0)->is_time(), true);
+
+    // Objects that are not pseudo-types that Datum supports, or that are
+    // malformed, come back as they were
+    TEST_EQ(*parsed.get_nth(1), R::Datum(R::Object{
+        {"$reql_type$", "GEOMETRY"}, {"type", "Point"}, {"coordinates", R::Array{1, 2}}}));
+    TEST_EQ(*parsed.get_nth(2), R::Datum(R::Object{
+        {"$reql_type$", "UNKNOWN"}, {"a", R::Object{{"b", 1}}}}));
+    TEST_EQ(*parsed.get_nth(3), R::Datum(R::Object{{"$reql_type$", "TIME"}, {"epoch_time", 1}}));
+    TEST_EQ(*parsed.get_nth(4), R::Datum(R::Object{{"$reql_type$", "BINARY"}, {"data", "A"}}));
+    TEST_EQ(parsed.get_nth(1)->from_raw(), *parsed.get_nth(1));
+    TEST_EQ(parsed.get_nth(2)->as_json(), std::string("{\"$reql_type$\":\"UNKNOWN\",\"a\":{\"b\":1}}"));
+    exit_section();
+}
+
+void test_integers() {
+    enter_section("integers");
+    R::Datum parsed = R::Datum::from_json("[9007199254740993,-5,1.5]");
+    TEST_EQ(parsed.get_nth(0)->extract_integer(), 9007199254740993LL);
+    TEST_EQ(parsed.get_nth(2)->is_integer(), false);
+    TEST_EQ(parsed.as_json(), std::string("[9007199254740993,-5,1.5]"));
+    // Reading a large integer as a number keeps it exact
+    TEST_EQ(parsed.get_nth(0)->extract_number(), 9007199254740992.0);
+    *parsed.get_nth(0)->get_number() += 10;
+    TEST_EQ(parsed.get_nth(0)->is_integer(), true);
+    TEST_EQ(parsed.as_json(), std::string("[9007199254740993,-5,1.5]"));
+    TEST_EQ(*parsed.get_nth(0), R::Datum(9007199254740993LL));
+    TEST_EQ(R::Datum(3), R::Datum(3.0));
+    TEST_EQ(R::Datum(2).compare(R::Datum(2.5)), -1);
+    TEST_EQ(R::Datum(4.0).extract_integer(), 4);
+    TEST_EQ((R::expr(1) + 2).run(*conn), R::Datum(3));
+    exit_section();
+}
+
 void test_issue28() {
     enter_section("issue #28");
     std::vector<std::string> expected{ "rethinkdb", "test" };
@@ -85,6 +397,616 @@ void test_issue28() {
     exit_section();
 }
 
+void test_reader_thread() {
+    enter_section("reader thread");
+    R::ConnectOptions options;
+    options.reader_thread = true;
+    std::unique_ptr<R::Connection> threaded = R::connect("localhost", 28015, "", options);
+    std::vector<size_t> sizes(8);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        threads.emplace_back([&sizes, &threaded, i]() {
+            sizes[i] = R::range(1000 * i).run(*threaded).to_array().size();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        TEST_EQ(sizes[i], 1000 * i);
+    }
+    TEST_EQ((R::expr(1) + 2).run(*threaded), R::Datum(3));
+    threaded->close();
+    exit_section();
+}
+
+void test_defer_parsing() {
+    enter_section("defer parsing");
+    R::ConnectOptions options;
+    options.reader_thread = true;
+    options.defer_parsing = true;
+    std::unique_ptr<R::Connection> deferred = R::connect("localhost", 28015, "", options);
+    std::vector<size_t> sizes(8);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        threads.emplace_back([&sizes, &deferred, i]() {
+            sizes[i] = R::range(1000 * i).run(*deferred).to_array().size();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        TEST_EQ(sizes[i], 1000 * i);
+    }
+    TEST_EQ(R::expr(R::Object{{"a", R::Array{1, "b"}}}).run(*deferred),
+            R::Datum(R::Object{{"a", R::Array{1, "b"}}}));
+    deferred->close();
+    exit_section();
+}
+
+void test_views() {
+    enter_section("views");
+    R::ConnectOptions options;
+    options.defer_parsing = true;
+    std::unique_ptr<R::Connection> deferred = R::connect("localhost", 28015, "", options);
+    R::Cursor cursor = R::range(10000).run(*deferred);
+    TEST_EQ(cursor.next(), R::Datum(0));
+    size_t count = 1;
+    double sum = 0;
+    while (true) {
+        R::DatumView batch = cursor.next_batch_view();
+        if (batch.size() == 0) {
+            break;
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            sum += batch.get_nth(i).extract_number();
+            ++count;
+        }
+    }
+    TEST_EQ(count, 10000);
+    TEST_EQ(sum, 10000.0 * 9999 / 2);
+
+    R::DatumView rows = R::expr(R::Array{R::Object{{"name", "a"}, {"at", R::Time(1)}}})
+        .run(*deferred).next_batch_view();
+    TEST_EQ(rows.size(), 1);
+    TEST_EQ(rows.get_nth(0).extract_field("name").extract_string(), std::string("a"));
+    TEST_EQ(rows.get_nth(0).get_field("missing").is_valid(), false);
+    TEST_EQ(rows.get_nth(0).get_field("at").is_object(), true);
+    TEST_EQ(rows.get_nth(0).to_datum().extract_field("at"), R::Datum(R::Time(1)));
+    deferred->close();
+    exit_section();
+}
+
+void test_io_uring() {
+    enter_section("io_uring");
+    R::ConnectOptions options;
+    options.io_uring = true;
+    std::vector<std::unique_ptr<R::Connection>> conns;
+    std::vector<std::future<R::Cursor>> futures;
+    for (int i = 0; i < 4; ++i) {
+        conns.emplace_back(R::connect("localhost", 28015, "", options));
+        futures.emplace_back(R::range(1000 * i).count().run_async(*conns.back()));
+    }
+    for (int i = 0; i < 4; ++i) {
+        TEST_EQ(futures[i].get().to_datum(), R::Datum(1000 * i));
+    }
+    TEST_EQ(R::range(10000).run(*conns[0]).to_array().size(), 10000);
+    for (auto& conn : conns) {
+        conn->close();
+    }
+
+    StandInServer server([](size_t, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        if (query_type(query) == 1 && *query.get_nth(1) == R::Datum("fail")) {
+            responses.emplace_back(token, "{\"t\":18,\"r\":[\"failed\"]}");
+        } else if (query_type(query) == 1) {
+            responses.emplace_back(token, StandInServer::atom(*query.get_nth(1)));
+        }
+        return responses;
+    });
+
+    // Responses larger than the buffers of the loop arrive in several recvs
+    std::unique_ptr<R::Connection> ring = R::connect(server.host, server.port, "", options);
+    std::string large(100000, 'x');
+    TEST_EQ(R::expr(large).run(*ring), R::Datum(large));
+
+    // Callbacks run on the loop's thread, which must not wait for itself
+    // when they close or destroy their connection. Only errbacks can
+    // destroy it, since cursors must not outlive their connection. They
+    // wait for run_async to return, which still uses the connection
+    std::promise<void> started;
+    std::shared_future<void> running = started.get_future().share();
+    std::promise<bool> closed;
+    R::expr(1).run_async(*ring, [&ring, &closed, running](R::Cursor&&) {
+        running.wait();
+        ring->close();
+        closed.set_value(true);
+    }, [&closed](R::Error&&) { closed.set_value(false); });
+    started.set_value();
+    std::future<bool> closing = closed.get_future();
+    TEST_EQ(closing.wait_for(std::chrono::seconds(5)) == std::future_status::ready && closing.get(), true);
+
+    std::promise<void> restarted;
+    running = restarted.get_future().share();
+    std::promise<bool> destroyed;
+    std::unique_ptr<R::Connection> owned = R::connect(server.host, server.port, "", options);
+    R::expr("fail").run_async(*owned, [&destroyed](R::Cursor&&) { destroyed.set_value(false); },
+                              [&owned, &destroyed, running](R::Error&&) {
+        running.wait();
+        owned.reset();
+        destroyed.set_value(true);
+    });
+    restarted.set_value();
+    std::future<bool> destroying = destroyed.get_future();
+    TEST_EQ(destroying.wait_for(std::chrono::seconds(5)) == std::future_status::ready && destroying.get(), true);
+
+    // The loop keeps serving the other connections
+    std::unique_ptr<R::Connection> other = R::connect(server.host, server.port, "", options);
+    TEST_EQ(R::expr(2).run(*other), R::Datum(2));
+    other->close();
+    exit_section();
+}
+
+void test_async() {
+    enter_section("async");
+    // run_async starts a reader thread, which the shared connection must not have
+    std::unique_ptr<R::Connection> async = R::connect();
+    std::vector<std::future<R::Cursor>> futures;
+    for (int i = 0; i < 10; ++i) {
+        futures.emplace_back((R::expr(i) + 1).run_async(*async));
+    }
+    for (int i = 0; i < 10; ++i) {
+        TEST_EQ(futures[i].get().to_datum(), R::Datum(i + 1));
+    }
+    R::Cursor cursor = R::range(10000).run_async(*async).get();
+    size_t total = 0;
+    while (true) {
+        R::Array batch = cursor.next_batch_async().get();
+        if (batch.empty()) break;
+        total += batch.size();
+    }
+    TEST_EQ(total, 10000);
+
+    // What a callback throws goes to its errback, not to the reader thread
+    std::promise<std::string> failure;
+    R::expr(1).run_async(*async, [](R::Cursor&&) { throw R::Error("thrown by the callback"); },
+                         [&failure](R::Error&& error) { failure.set_value(error.message); });
+    TEST_EQ(failure.get_future().get(), std::string("thrown by the callback"));
+    TEST_EQ(R::expr(2).run(*async), R::Datum(2));
+    async->close();
+
+    // The response to an asynchronous query can be read by a thread that
+    // is waiting for another query, before the reader thread starts
+    uint64_t held = 0;
+    StandInServer server([&held](size_t, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        if (query_type(query) != 1) {
+            return responses;
+        }
+        if (*query.get_nth(1) == R::Datum("slow")) {
+            held = token;
+            return responses;
+        }
+        responses.emplace_back(token, StandInServer::atom(*query.get_nth(1)));
+        if (held) {
+            responses.emplace_back(held, StandInServer::atom("slow"));
+        }
+        return responses;
+    });
+    std::unique_ptr<R::Connection> reading = R::connect(server.host, server.port);
+    R::Datum slow;
+    std::thread waiting([&slow, &reading]() { slow = R::expr("slow").run(*reading).to_datum(); });
+    TEST_EQ(eventually([&server]() { return server.queries() == 1; }), true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::future<R::Cursor> fast = R::expr("fast").run_async(*reading);
+    bool ready = fast.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+    TEST_EQ(ready, true);
+    waiting.join();
+    if (ready) {
+        TEST_EQ(fast.get().to_datum(), R::Datum("fast"));
+    }
+    TEST_EQ(slow, R::Datum("slow"));
+    reading->close();
+    exit_section();
+}
+
+void test_reconnect() {
+    enter_section("reconnect");
+    // The first connection answers nothing, the next ones echo the term
+    StandInServer server([](size_t connection, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        if (connection > 0 && query_type(query) == 1) {
+            responses.emplace_back(token, StandInServer::atom(*query.get_nth(1)));
+        }
+        return responses;
+    });
+    R::ConnectOptions options;
+    options.reconnect = true;
+    std::unique_ptr<R::Connection> reconnecting = R::connect(server.host, server.port, "", options);
+    std::future<R::Cursor> read = R::expr("read").run_async(*reconnecting);
+    std::future<R::Cursor> write =
+        R::db("test").table("t").insert(R::Object{{"a", 1}}).run_async(*reconnecting);
+    TEST_EQ(eventually([&server]() { return server.queries() == 2; }), true);
+    server.drop();
+
+    // Only the read-only query is sent again
+    bool ready = read.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+    TEST_EQ(ready, true);
+    if (ready) {
+        TEST_EQ(read.get().to_datum(), R::Datum("read"));
+    }
+    std::string error;
+    try {
+        write.get();
+    } catch (const R::Error& e) {
+        error = e.message;
+    }
+    TEST_EQ(error.compare(0, 24, "ReqlOpIndeterminateError"), 0);
+    TEST_EQ(server.connections(), 2);
+    TEST_EQ(server.queries(), 3);
+    TEST_EQ(R::expr(1).run(*reconnecting), R::Datum(1));
+    reconnecting->close();
+    exit_section();
+}
+
+void test_connect_timeout() {
+    enter_section("connect timeout");
+    // The kernel completes connections to a socket that listens but never
+    // accepts, and nothing answers the handshake. Once its queue is full,
+    // further attempts hang, as with an unreachable host
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr);
+    socklen_t len = sizeof addr;
+    getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr), &len);
+    listen(listener, 0);
+
+    R::ConnectOptions options;
+    options.connect_timeout = 0.2;
+    for (int i = 0; i < 3; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        std::string error;
+        try {
+            R::connect("127.0.0.1", ntohs(addr.sin_port), "", options);
+        } catch (const R::Error& e) {
+            error = e.message;
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        TEST_EQ(error.compare(0, 18, "connect: timed out"), 0);
+        TEST_EQ(elapsed < 0.5, true);
+    }
+    close(listener);
+    exit_section();
+}
+
+void test_unix_socket() {
+    enter_section("unix socket");
+    StandInServer server([](size_t, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        if (query_type(query) == 1) {
+            responses.emplace_back(token, StandInServer::atom(*query.get_nth(1)));
+        }
+        return responses;
+    }, "/tmp/rethinkdb-cpp-test-" + std::to_string(getpid()) + ".sock");
+    std::unique_ptr<R::Connection> local = R::connect(server.host);
+    TEST_EQ(R::expr("over a unix socket").run(*local), R::Datum("over a unix socket"));
+    local->close();
+
+    bool rejected = false;
+    try {
+        R::connect("unix:");
+    } catch (const R::Error&) {
+        rejected = true;
+    }
+    TEST_EQ(rejected, true);
+    exit_section();
+}
+
+void test_prefetch() {
+    enter_section("prefetch");
+    for (size_t batches : {0, 1, 4}) {
+        R::Cursor cursor = R::range(100000).run(*conn);
+        cursor.set_prefetch(batches, batches * 1024);
+        size_t count = 0;
+        while (cursor.has_next()) {
+            cursor.next();
+            ++count;
+        }
+        TEST_EQ(count, 100000);
+    }
+
+    // Batches are only requested while the queue has room, so the server
+    // never gets more CONTINUEs than the consumer has taken batches, plus
+    // the window. A reader thread fills the queue while the consumer is
+    // idle. Every batch is 45 bytes on the wire: 100 bytes hold three
+    std::atomic<size_t> continues(0);
+    StandInServer server([&continues](size_t, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        if (query_type(query) == 2) {
+            ++continues;
+        }
+        if (query_type(query) == 1 || query_type(query) == 2) {
+            responses.emplace_back(token, "{\"t\":3,\"r\":[0,1,2,3,4,5,6,7,8,9]}");
+        }
+        return responses;
+    });
+    struct Window { size_t batches, bytes, queued; };
+    for (Window window : {Window{1, 0, 1}, Window{4, 0, 4}, Window{100, 100, 3}}) {
+        R::ConnectOptions options;
+        options.reader_thread = true;
+        options.prefetch_batches = window.batches;
+        options.prefetch_bytes = window.bytes;
+        std::unique_ptr<R::Connection> windowed = R::connect(server.host, server.port, "", options);
+        continues = 0;
+        R::Cursor cursor = R::expr(1).run(*windowed);
+        TEST_EQ(eventually([&]() { return continues == window.queued; }), true);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        TEST_EQ(continues.load(), window.queued);
+
+        // The first batch came with the cursor, the others from the queue
+        bool within = true;
+        for (size_t rows = 1; rows <= 100; ++rows) {
+            cursor.next();
+            size_t taken = (rows - 1) / 10;
+            within = within && continues <= taken + window.queued;
+        }
+        TEST_EQ(within, true);
+        cursor.close();
+        windowed->close();
+    }
+    exit_section();
+}
+
+void test_coalesce() {
+    enter_section("coalesce");
+    // Streams stay open, and a query on "hold" stops the server from
+    // reading until it is released
+    std::vector<int> types;
+    std::atomic<size_t> stops(0);
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    StandInServer server([&types, &stops, released](size_t, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        types.push_back(query_type(query));
+        if (query_type(query) == 3) {
+            ++stops;
+        }
+        if (query_type(query) != 1) {
+            return responses;
+        }
+        if (*query.get_nth(1) == R::Datum("hold")) {
+            released.wait();
+        }
+        if (*query.get_nth(1) == R::Datum("stream")) {
+            responses.emplace_back(token, "{\"t\":3,\"r\":[1]}");
+        } else {
+            responses.emplace_back(token, StandInServer::atom(1));
+        }
+        return responses;
+    }, "/tmp/rethinkdb-cpp-test-" + std::to_string(getpid()) + ".sock");
+    std::unique_ptr<R::Connection> local = R::connect(server.host);
+    std::vector<R::Cursor> streams;
+    for (int i = 0; i < 3; ++i) {
+        streams.emplace_back(R::expr("stream").run(*local));
+    }
+
+    // While a large query cannot be sent, the STOPs of the streams queue
+    // up behind it, and then go out together
+    std::future<R::Cursor> hold = R::expr("hold").run_async(*local);
+    std::thread large([&local]() { R::expr(std::string(4 * 1024 * 1024, 'x')).run(*local); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::vector<std::thread> closing;
+    for (auto& stream : streams) {
+        closing.emplace_back([&stream]() { stream.close(); });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    release.set_value();
+    for (auto& thread : closing) {
+        thread.join();
+    }
+    large.join();
+    TEST_EQ(hold.get().to_datum(), R::Datum(1));
+    TEST_EQ(eventually([&stops]() { return stops == 3; }), true);
+
+    std::vector<size_t> reads = server.reads_of_queries();
+    std::set<size_t> stop_reads;
+    for (size_t i = 0; i < reads.size(); ++i) {
+        if (types[i] == 3) {
+            stop_reads.insert(reads[i]);
+        }
+    }
+    TEST_EQ(stop_reads.size(), 1);
+    local->close();
+    exit_section();
+}
+
+void test_tune_batches() {
+    enter_section("tune_batches");
+    R::ConnectOptions options;
+    options.tune_batches = true;
+    std::unique_ptr<R::Connection> tuned = R::connect("localhost", 28015, "", options);
+    for (int i = 0; i < 3; ++i) {
+        TEST_EQ(R::range(100000).run(*tuned).to_array().size(), 100000);
+        R::Cursor cursor = R::range(100000 + i).run(*tuned);
+        TEST_EQ(cursor.next(), R::Datum(0));
+        TEST_EQ(cursor.next(), R::Datum(1));
+    }
+    tuned->close();
+    exit_section();
+}
+
+void test_pool() {
+    enter_section("pool");
+    R::PoolOptions options;
+    options.connections_per_host = 3;
+    R::ConnectionPool pool({{"localhost", 28015}}, options);
+    TEST_EQ(pool.size(), 3);
+    std::shared_ptr<R::Connection> first = pool.get();
+    R::Cursor cursor = R::range(100000).run(*first);
+    TEST_EQ(pool.get() != first, true);
+    TEST_EQ(R::expr(1).run(*pool.get()), R::Datum(1));
+    cursor.close();
+    pool.close();
+    TEST_EQ(pool.size(), 0);
+
+    // Connections whose server goes away are noticed, whether they are in
+    // use or idle, and replaced
+    StandInServer server([](size_t, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        if (query_type(query) == 1 && *query.get_nth(1) == R::Datum("stream")) {
+            responses.emplace_back(token, "{\"t\":3,\"r\":[1]}");
+        } else if (query_type(query) == 1) {
+            responses.emplace_back(token, StandInServer::atom(*query.get_nth(1)));
+        }
+        return responses;
+    });
+    R::PoolOptions failing;
+    failing.connections_per_host = 2;
+    failing.ping_interval = 0.5;
+    failing.reconnect_interval = 0.05;
+    R::ConnectionPool replaced({{server.host, server.port}}, failing);
+    std::shared_ptr<R::Connection> used = replaced.get();
+    TEST_EQ(R::expr(1).run(*used), R::Datum(1));
+    server.drop();
+    bool lost = false;
+    try {
+        R::expr(2).run(*used);
+    } catch (const R::Error&) {
+        lost = true;
+    }
+    TEST_EQ(lost, true);
+    TEST_EQ(eventually([&]() { return server.connections() == 4 && replaced.size() == 2; }), true);
+    TEST_EQ(replaced.get() != used, true);
+    TEST_EQ(R::expr(3).run(*replaced.get()), R::Datum(3));
+    replaced.close();
+
+    // Hosts with too many outstanding queries are skipped
+    R::PoolOptions capped;
+    capped.connections_per_host = 2;
+    capped.max_outstanding_per_host = 1;
+    R::ConnectionPool limited({{server.host, server.port}}, capped);
+    std::shared_ptr<R::Connection> busy = limited.get();
+    R::Cursor stream = R::expr("stream").run(*busy);
+    bool refused = false;
+    try {
+        limited.get();
+    } catch (const R::Error&) {
+        refused = true;
+    }
+    TEST_EQ(refused, true);
+    stream.close();
+    limited.close();
+
+    // Closing does not wait for a connection that is still being opened.
+    // The silent host accepts connections but never answers the handshake
+    int silent = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(silent, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr);
+    socklen_t len = sizeof addr;
+    getsockname(silent, reinterpret_cast<struct sockaddr*>(&addr), &len);
+    listen(silent, 16);
+    R::PoolOptions slow;
+    slow.connections_per_host = 1;
+    slow.reconnect_interval = 0.01;
+    slow.connect_options.connect_timeout = 1;
+    std::unique_ptr<R::ConnectionPool> opening(new R::ConnectionPool(
+        {{server.host, server.port}, {"127.0.0.1", ntohs(addr.sin_port)}}, slow));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto start = std::chrono::steady_clock::now();
+    opening.reset();
+    TEST_EQ(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500), true);
+    close(silent);
+    exit_section();
+}
+
+void test_run_many() {
+    enter_section("run_many");
+    std::vector<R::Term> terms;
+    for (int i = 0; i < 100; ++i) {
+        terms.emplace_back(R::expr(i) * 2);
+    }
+    terms.emplace_back(R::range(5000));
+    std::vector<R::Cursor> cursors = conn->run_many(std::move(terms));
+    TEST_EQ(cursors.size(), 101);
+    for (int i = 0; i < 100; ++i) {
+        TEST_EQ(cursors[i].to_datum(), R::Datum(i * 2));
+    }
+    TEST_EQ(cursors[100].to_array().size(), 5000);
+    exit_section();
+}
+
+void test_deadline() {
+    enter_section("deadline");
+    bool timed_out = false;
+    try {
+        R::range(100000000).count().run(*conn, {}, 0.01);
+    } catch (const R::TimeoutException&) {
+        timed_out = true;
+    }
+    TEST_EQ(timed_out, true);
+    TEST_EQ(R::expr(1).run(*conn), R::Datum(1));
+    exit_section();
+}
+
+void test_ingest() {
+    enter_section("ingest");
+    R::db("test").table_create("ingest").run(*conn);
+    size_t progress = 0;
+    R::IngestOptions options;
+    options.checkpoint_writes = 100;
+    options.on_progress = [&](size_t confirmed) { progress = confirmed; };
+    {
+        R::IngestStream stream(*conn, options);
+        for (int i = 0; i < 1000; ++i) {
+            stream.write(R::db("test").table("ingest").insert(R::Object{{"n", i}}));
+        }
+        stream.flush();
+        TEST_EQ(stream.confirmed(), 1000);
+        TEST_EQ(progress, 1000);
+        stream.write(R::db("test").table("ingest").insert(R::Object{{"n", 1000}}));
+    }
+    TEST_EQ(progress, 1001);
+    TEST_EQ(R::db("test").table("ingest").count().run(*conn), R::Datum(1001));
+    R::db("test").table("ingest").insert(R::Object{{"n", 1001}}).run(*conn, {{"noreply", R::Term(true)}});
+    conn->noreply_wait();
+    TEST_EQ(R::db("test").table("ingest").count().run(*conn), R::Datum(1002));
+    R::db("test").table_drop("ingest").run(*conn);
+
+    // A failed checkpoint fails the stream instead of the connection
+    StandInServer server([](size_t, uint64_t token, const R::Datum& query) {
+        StandInServer::Responses responses;
+        if (query_type(query) == 4) {
+            responses.emplace_back(token, R::Datum(R::Object{
+                {"t", 18}, {"e", 1000000}, {"r", R::Array{"checkpoint failed"}}}).as_json());
+        }
+        return responses;
+    });
+    std::unique_ptr<R::Connection> failing = R::connect(server.host, server.port);
+    {
+        R::IngestStream stream(*failing);
+        stream.write(R::db("test").table("ingest").insert(R::Object{{"n", 0}}));
+        std::string error;
+        try {
+            stream.flush(5);
+        } catch (const R::Error& e) {
+            error = e.message;
+        } catch (const R::TimeoutException&) {
+            error = "timed out";
+        }
+        TEST_EQ(error, std::string("ReqlInternalError: checkpoint failed"));
+        TEST_EQ(stream.confirmed(), 0);
+    }
+    failing->close();
+    exit_section();
+}
+
 int main() {
     signal(SIGPIPE, SIG_IGN);
     srand(time(NULL));
@@ -99,7 +1021,25 @@ int main() {
         //test_json_parse_print();
         //test_reql();
         //test_cursor();
+        test_base64_round_trip();
+        test_pseudo_types();
+        test_integers();
         test_issue28();
+        test_reader_thread();
+        test_defer_parsing();
+        test_views();
+        test_io_uring();
+        test_connect_timeout();
+        test_unix_socket();
+        test_async();
+        test_reconnect();
+        test_prefetch();
+        test_coalesce();
+        test_tune_batches();
+        test_pool();
+        test_run_many();
+        test_deadline();
+        test_ingest();
         run_upstream_tests();
     } catch (const R::Error& error) {
         printf("FAILURE: uncaught expception: %s\n", error.message.c_str());